@@ -18,25 +18,27 @@
 
 #include "battery_reader.h"
 #include <logging/log.h>
+
+#include "energy_counters.h"
+#include "event_trace.h"
+#include "perf_counters.h"
+
 LOG_MODULE_REGISTER(battery_reader);
 
 
-BatteryReader::BatteryReader(std::shared_ptr<device> adc_device, uint16_t ref_voltage,
-                             uint16_t min_voltage, uint16_t max_voltage, uint8_t sense_pin,
-                             float divider_ratio, const map_fn map_function)
-    : adc_device{adc_device},
-      ref_voltage{ref_voltage},
-      min_voltage{min_voltage},
-      max_voltage{max_voltage},
-      divider_ratio{divider_ratio},
-      map_function{map_function},
-      channel_config{.gain = ADC_GAIN_1_6,
-                     .reference = ADC_REF_INTERNAL,
-                     .acquisition_time = ADC_ACQ_TIME_DEFAULT,
-                     .channel_id = sense_pin,
-                     .differential = 0,
-                     .input_positive = (uint8_t)(sense_pin + 1)} {
-    int error = adc_channel_setup(adc_device.get(), &channel_config);
+void BatteryReader::init(device *adc_device, uint16_t ref_voltage, uint16_t min_voltage,
+                         uint16_t max_voltage, uint8_t sense_pin, float divider_ratio,
+                         const map_fn map_function) {
+    this->adc_device = adc_device;
+    configure(ref_voltage, min_voltage, max_voltage, divider_ratio, map_function);
+    channel_config = {.gain = ADC_GAIN_1_6,
+                      .reference = ADC_REF_INTERNAL,
+                      .acquisition_time = ADC_ACQ_TIME_DEFAULT,
+                      .channel_id = sense_pin,
+                      .differential = 0,
+                      .input_positive = (uint8_t)(sense_pin + 1)};
+
+    int error = adc_channel_setup(adc_device, &channel_config);
     if (error) {
         LOG_ERR("ADC setup failed");
     } else {
@@ -44,6 +46,15 @@ BatteryReader::BatteryReader(std::shared_ptr<device> adc_device, uint16_t ref_vo
     }
 }
 
+void BatteryReader::configure(uint16_t ref_voltage, uint16_t min_voltage, uint16_t max_voltage,
+                              float divider_ratio, const map_fn map_function) {
+    this->ref_voltage = ref_voltage;
+    this->min_voltage = min_voltage;
+    this->max_voltage = max_voltage;
+    this->divider_ratio = divider_ratio;
+    this->map_function = map_function;
+}
+
 uint8_t BatteryReader::level() { return this->level(this->voltage()); }
 
 uint8_t BatteryReader::level(uint16_t voltage) {
@@ -57,6 +68,8 @@ uint8_t BatteryReader::level(uint16_t voltage) {
 }
 
 uint16_t BatteryReader::voltage() {
+    PerfScope perf_scope{PERF_BATTERY_VOLTAGE};
+    EnergyScope energy_scope{ENERGY_ADC_SAMPLING};
     const adc_sequence sequence = {
         .options = NULL,                                   // extra samples and callback
         .channels = BIT(this->channel_config.channel_id),  // bit mask of channels to read
@@ -67,14 +80,15 @@ uint16_t BatteryReader::voltage() {
         .calibrate = 0      // don't calibrate
     };
 
-    int error = adc_read(adc_device.get(), &sequence);
+    int error = adc_read(adc_device, &sequence);
 
     if (error) {
         LOG_ERR("ADC sampling failed");
+        trace(TRACE_ERROR, TRACE_ERROR_ADC, error);
         return 0;
     } else {
         uint16_t reading = this->sample_buffer * divider_ratio * ref_voltage / 1024;
-        LOG_INF("Battery reading: %umV", reading);
+        trace(TRACE_BATTERY_VOLTAGE, reading);
         return reading;
     }
 }
@@ -7,25 +7,22 @@
 #include <math.h>
 #include <zephyr.h>
 
-#include <functional>
-#include <memory>
-
-typedef std::function<uint8_t(uint16_t, uint16_t, uint16_t)> map_fn;
+typedef uint8_t (*map_fn)(uint16_t voltage, uint16_t min_voltage, uint16_t max_voltage);
 
 class BatteryReader {
    private:
-    std::shared_ptr<device> adc_device;
-    uint16_t ref_voltage;
-    uint16_t min_voltage;
-    uint16_t max_voltage;
-    float divider_ratio;
-    const map_fn map_function;
-    adc_channel_cfg channel_config;
-    int16_t sample_buffer;
+    device *adc_device = nullptr;
+    uint16_t ref_voltage = 0;
+    uint16_t min_voltage = 0;
+    uint16_t max_voltage = 0;
+    float divider_ratio = 1;
+    map_fn map_function = nullptr;
+    adc_channel_cfg channel_config = {};
+    int16_t sample_buffer = 0;
 
    public:
     /**
-     * Creates an instance to monitor battery voltage and level.
+     * Sets up an instance to monitor battery voltage and level.
      * Initialization parameters depend on battery type and configuration.
      *
      * @param adc_device is the zephyr ADC device that the sense_pin is bound to
@@ -36,9 +33,15 @@ class BatteryReader {
      * @param divider_ratio is the multiplier used to obtain the real battery voltage
      * @param map_fn is the function that will map the voltage reading to a battery percentage
      */
-    BatteryReader(std::shared_ptr<device> adc_device, uint16_t ref_voltage, uint16_t min_voltage,
-                  uint16_t max_voltage, uint8_t sense_pin, float divider_ratio,
-                  const map_fn map_function);
+    void init(device *adc_device, uint16_t ref_voltage, uint16_t min_voltage,
+              uint16_t max_voltage, uint8_t sense_pin, float divider_ratio,
+              const map_fn map_function);
+
+    /**
+     * Replaces the battery type parameters of a running instance, see init() for details.
+     */
+    void configure(uint16_t ref_voltage, uint16_t min_voltage, uint16_t max_voltage,
+                   float divider_ratio, const map_fn map_function);
 
     /**
      * Returns the current battery level as a number between 0 and 100, with 0 indicating an empty
@@ -102,4 +105,25 @@ static inline uint8_t linear(uint16_t voltage, uint16_t min_voltage, uint16_t ma
     return (unsigned long)(voltage - min_voltage) * 100 / (max_voltage - min_voltage);
 }
 
+/**
+ * Selectable battery curves, as stored in the runtime configuration
+ */
+enum battery_curve : uint8_t {
+    BATTERY_CURVE_SIGMOIDAL,
+    BATTERY_CURVE_ASIGMOIDAL,
+    BATTERY_CURVE_LINEAR,
+    BATTERY_CURVE_COUNT
+};
+
+static inline map_fn battery_curve_function(uint8_t curve) {
+    switch (curve) {
+        case BATTERY_CURVE_ASIGMOIDAL:
+            return asigmoidal;
+        case BATTERY_CURVE_LINEAR:
+            return linear;
+        default:
+            return sigmoidal;
+    }
+}
+
 #endif
\ No newline at end of file
@@ -3,17 +3,27 @@
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/conn.h>
 #include <bluetooth/gap.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_vs.h>
 #include <logging/log.h>
 #include <settings/settings.h>
+#include <sys/byteorder.h>
+
+#include "energy_counters.h"
+#include "event_trace.h"
+#include "perf_counters.h"
 
-#include <algorithm>
-#include <functional>
-#include <memory>
 LOG_MODULE_REGISTER(ble_conn_mgr);
 
 namespace {
-bt_conn *connection;
-std::unique_ptr<bt_addr_le_t> paired_addr = nullptr;
+// written from the BT RX thread, read from main and the system work queue. connection is only
+// swapped under connection_lock, link_state is cleared before the connection is released.
+bt_conn *connection = nullptr;
+struct k_spinlock connection_lock;
+atomic_t link_state = ATOMIC_INIT(0);
+atomic_t connection_generation = ATOMIC_INIT(0);
+bt_addr_le_t paired_addr;
+bool has_paired_addr = false;
 const struct bt_data advertising_data[] = {
     BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
     BT_DATA_BYTES(BT_DATA_UUID16_ALL, 0x12, 0x18, /* HID Service */
@@ -24,8 +34,19 @@ const bt_le_adv_param advertising_parameters{
     .options = BT_LE_ADV_OPT_CONNECTABLE | BT_LE_ADV_OPT_USE_NAME,
     .interval_min = BT_GAP_ADV_FAST_INT_MIN_1,
     .interval_max = BT_GAP_ADV_FAST_INT_MAX_1};
-std::function<void()> init_callback = nullptr;
+ble_ready_callback init_callback = nullptr;
+bool initialised = false;
 static struct k_work advertise_work;
+K_SEM_DEFINE(connection_ready, 0, 1);
+
+// link settings requested for all connections, applied from the system work queue on connect
+int8_t tx_power_dbm = 4;
+bt_le_conn_param conn_params;
+bool has_conn_params = false;
+void apply_tx_power(struct k_work *work);
+void apply_conn_params(struct k_work *work);
+K_WORK_DEFINE(tx_power_work, apply_tx_power);
+K_WORK_DEFINE(conn_params_work, apply_conn_params);
 
 static int paired_settings_set(const char *name, size_t len, settings_read_cb read_cb,
                                void *cb_arg) {
@@ -38,12 +59,9 @@ static int paired_settings_set(const char *name, size_t len, settings_read_cb re
 
         LOG_DBG("Reading paired device");
 
-        bt_addr_le_t saved_addr;
-        int err = read_cb(cb_arg, &saved_addr, sizeof(saved_addr));
+        int err = read_cb(cb_arg, &paired_addr, sizeof(paired_addr));
         if (err >= 0) {
-            paired_addr = std::make_unique<bt_addr_le_t>();
-            paired_addr->a = saved_addr.a;
-            paired_addr->type = saved_addr.type;
+            has_paired_addr = true;
             return 0;
         } else {
             return err;
@@ -55,16 +73,95 @@ static int paired_settings_set(const char *name, size_t len, settings_read_cb re
     return -ENOENT;
 }
 
+void set_link_flags(atomic_val_t flags) {
+    const atomic_val_t previous = atomic_or(&link_state, flags);
+    if ((previous | flags) == BLE_LINK_READY && previous != BLE_LINK_READY) {
+        k_sem_give(&connection_ready);
+    }
+}
+
+void clear_link_flags(atomic_val_t flags) { atomic_and(&link_state, ~flags); }
+
+// reference to the connection regardless of its state, for disconnecting it
+bt_conn *reference_connection() {
+    k_spinlock_key_t key = k_spin_lock(&connection_lock);
+    bt_conn *conn = connection ? bt_conn_ref(connection) : nullptr;
+    k_spin_unlock(&connection_lock, key);
+
+    return conn;
+}
+
 struct settings_handler paired_conf = {.name = "paired", .h_set = paired_settings_set};
 
+// handle_type is BT_HCI_VS_LL_HANDLE_TYPE_ADV or BT_HCI_VS_LL_HANDLE_TYPE_CONN
+int write_tx_power(uint8_t handle_type, uint16_t handle, int8_t dbm, int8_t *selected_dbm) {
+    struct net_buf *buf = bt_hci_cmd_create(BT_HCI_OP_VS_WRITE_TX_POWER_LEVEL,
+                                            sizeof(bt_hci_cp_vs_write_tx_power_level));
+    if (!buf) {
+        return -ENOBUFS;
+    }
+
+    auto *cp = static_cast<bt_hci_cp_vs_write_tx_power_level *>(
+        net_buf_add(buf, sizeof(bt_hci_cp_vs_write_tx_power_level)));
+    cp->handle_type = handle_type;
+    cp->handle = sys_cpu_to_le16(handle);
+    cp->tx_power_level = dbm;
+
+    struct net_buf *rsp = nullptr;
+    const int err = bt_hci_cmd_send_sync(BT_HCI_OP_VS_WRITE_TX_POWER_LEVEL, buf, &rsp);
+    if (err) {
+        return err;
+    }
+
+    if (selected_dbm) {
+        *selected_dbm =
+            reinterpret_cast<bt_hci_rp_vs_write_tx_power_level *>(rsp->data)->selected_tx_power;
+    }
+    net_buf_unref(rsp);
+    return 0;
+}
+
+// applies dbm to the current connection, if any
+int write_connection_tx_power(int8_t dbm, int8_t *selected_dbm) {
+    bt_conn *conn = reference_connection();
+    if (!conn) {
+        return 0;
+    }
+
+    uint16_t handle = 0;
+    int err = bt_hci_get_conn_handle(conn, &handle);
+    if (!err) {
+        err = write_tx_power(BT_HCI_VS_LL_HANDLE_TYPE_CONN, handle, dbm, selected_dbm);
+    }
+    bt_conn_unref(conn);
+
+    return err;
+}
+
+void apply_tx_power(struct k_work *work) {
+    if (write_connection_tx_power(tx_power_dbm, nullptr)) {
+        LOG_WRN("Setting the connection TX power failed");
+    }
+}
+
+void apply_conn_params(struct k_work *work) {
+    bt_conn *conn = reference_connection();
+    if (conn) {
+        if (has_conn_params && bt_conn_le_param_update(conn, &conn_params)) {
+            LOG_WRN("Requesting connection parameters failed");
+        }
+        bt_conn_unref(conn);
+    }
+}
+
 void start_advertising(struct k_work *work) {
     bt_le_adv_stop();
     LOG_INF("Attempting to start advertising ...");
     int adv_err = 0;
 
-    if (paired_addr != nullptr) {
+    if (has_paired_addr) {
         char addr[BT_ADDR_LE_STR_LEN];
-        bt_addr_le_to_str(paired_addr.get(), addr, sizeof(addr));
+        bt_addr_le_to_str(&paired_addr, addr, sizeof(addr));
         LOG_INF("Paired device stored (%s), advertising with whitelist", log_strdup(addr));
 
         bt_le_adv_param directed_params = advertising_parameters;
@@ -74,11 +171,11 @@ void start_advertising(struct k_work *work) {
             LOG_ERR("Error while clearing whitelist");
         }
 
-        if(bt_le_whitelist_add(paired_addr.get())) {
+        if(bt_le_whitelist_add(&paired_addr)) {
             LOG_ERR("Error while adding paired device to whitelist");
         }
 
-        adv_err = bt_le_adv_start(&advertising_parameters, advertising_data,
+        adv_err = bt_le_adv_start(&directed_params, advertising_data,
                                   ARRAY_SIZE(advertising_data), nullptr, 0);
     } else {
         LOG_INF("No paired device stored, advertising globally");
@@ -88,9 +185,13 @@ void start_advertising(struct k_work *work) {
 
     if (adv_err) {
         LOG_ERR("Bluetooth adv failed to start");
+        trace(TRACE_ERROR, TRACE_ERROR_ADVERTISING, adv_err);
+        energy_set_radio_state(ENERGY_IDLE_SLEEP);
         return;
     } else {
         LOG_INF("Advertising succeeded!");
+        energy_set_radio_state(ENERGY_ADVERTISING);
+        perf_boot_mark(BOOT_ADVERTISING);
     }
 }
 
@@ -99,21 +200,28 @@ void ble_ready(int err) {
         LOG_ERR("Bluetooth initialization failed!");
         return;
     }
+    perf_boot_mark(BOOT_BT_READY);
 
     if (init_callback) {
         init_callback();
     }
 
+    // only load what advertising depends on here, the keyboard configuration is loaded by main
+    // in parallel
     if (IS_ENABLED(CONFIG_SETTINGS)) {
-        settings_load();
+        settings_load_subtree("bt");
+        settings_load_subtree("paired");
     }
+    perf_boot_mark(BOOT_BONDS_LOADED);
 
-    k_work_submit(&advertise_work);
+    // already running on the system work queue, no need to go through advertise_work
+    start_advertising(nullptr);
 }
 
 void connected(struct bt_conn *conn, u8_t err) {
     char addr[BT_ADDR_LE_STR_LEN];
     bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+    trace(TRACE_CONNECTED, err);
 
     if (err) {
         LOG_ERR("Failed to connect to %s (%d)", log_strdup(addr), err);
@@ -121,10 +229,19 @@ void connected(struct bt_conn *conn, u8_t err) {
     }
 
     LOG_INF("Connected %s", log_strdup(addr));
+    k_spinlock_key_t key = k_spin_lock(&connection_lock);
     connection = bt_conn_ref(conn);
+    k_spin_unlock(&connection_lock, key);
+    atomic_inc(&connection_generation);
+    set_link_flags(BLE_LINK_CONNECTED);
+    energy_set_radio_state(ENERGY_CONNECTED_IDLE);
+    perf_boot_mark(BOOT_CONNECTED);
+    // the HCI command blocks, which is not allowed on the Bluetooth RX thread
+    k_work_submit(&tx_power_work);
 
     if (bt_conn_set_security(conn, BT_SECURITY_L2)) {
         LOG_ERR("Failed to set security");
+        trace(TRACE_ERROR, TRACE_ERROR_SECURITY);
     }
 }
 
@@ -133,22 +250,41 @@ void disconnected(struct bt_conn *conn, u8_t reason) {
     bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 
     LOG_INF("Disconnected from %s (reason 0x%02x)", log_strdup(addr), reason);
+    trace(TRACE_DISCONNECTED, reason);
+
+    // unpublish first, so no new reference is handed out while the connection is released
+    clear_link_flags(BLE_LINK_READY);
 
-    bt_conn_unref(connection);
+    k_spinlock_key_t key = k_spin_lock(&connection_lock);
+    bt_conn *released = connection;
     connection = nullptr;
+    k_spin_unlock(&connection_lock, key);
 
+    if (released) {
+        bt_conn_unref(released);
+    }
+
+    energy_set_radio_state(ENERGY_IDLE_SLEEP);
     k_work_submit(&advertise_work);
 }
 
 void security_changed(struct bt_conn *conn, bt_security_t level, enum bt_security_err err) {
     char addr[BT_ADDR_LE_STR_LEN];
     bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+    trace(TRACE_SECURITY_CHANGED, level, err);
 
     if (err) {
         LOG_ERR("An error occurred during security level change for %s to level %d (error 0x%02x)",
                 log_strdup(addr), level, err);
     } else {
         LOG_INF("Security level for %s changed: level %d", log_strdup(addr), level);
+        if (level >= BT_SECURITY_L2) {
+            set_link_flags(BLE_LINK_SECURED);
+            perf_boot_mark(BOOT_SECURED);
+            if (has_conn_params) {
+                k_work_submit(&conn_params_work);
+            }
+        }
     }
 }
 
@@ -158,6 +294,7 @@ void le_param_updated(struct bt_conn *conn, u16_t interval, u16_t latency, u16_t
 
     LOG_INF("Connection parameters for %s changed: interval %d, latency %d, timeout %d",
             log_strdup(addr), interval, latency, timeout);
+    trace(TRACE_PARAMS_UPDATED, interval, latency);
 }
 
 void pairing_complete(struct bt_conn *conn, bool bonded) {
@@ -165,13 +302,12 @@ void pairing_complete(struct bt_conn *conn, bool bonded) {
     const bt_addr_le_t *central_addr = bt_conn_get_dst(conn);
     bt_addr_le_to_str(central_addr, addr, sizeof(addr));
 
-    if (paired_addr != nullptr) {
-        bt_unpair(BT_ID_DEFAULT, paired_addr.get());
+    if (has_paired_addr && bt_addr_le_cmp(&paired_addr, central_addr)) {
+        bt_unpair(BT_ID_DEFAULT, &paired_addr);
     }
-    settings_save_one("paired/one", central_addr, sizeof(central_addr));
-    paired_addr = std::make_unique<bt_addr_le_t>();
-    paired_addr->a = central_addr->a;
-    paired_addr->type = central_addr->type;
+    paired_addr = *central_addr;
+    has_paired_addr = true;
+    settings_save_one("paired/one", &paired_addr, sizeof(paired_addr));
 
     LOG_INF("Pairing for %s completed (bonded: %s)", log_strdup(addr), bonded ? "true" : "false");
 }
@@ -181,6 +317,7 @@ void pairing_failed(struct bt_conn *conn, enum bt_security_err reason) {
     bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 
     LOG_ERR("Pairing for %s failed (error code: %d)", log_strdup(addr), reason);
+    trace(TRACE_ERROR, TRACE_ERROR_PAIRING, reason);
 }
 
 struct bt_conn_cb conn_callbacks {
@@ -194,16 +331,18 @@ struct bt_conn_auth_cb auth_callbacks {
 };
 }  // namespace
 
-void ble_init(std::function<void()> callback) {
-    if (!init_callback) {
+void ble_init(ble_ready_callback callback) {
+    if (!initialised) {
         k_work_init(&advertise_work, start_advertising);
         init_callback = callback;
+        initialised = true;
     } else {
         LOG_INF("Bluetooth initialisation called multiple times. Skipping ... ");
         return;
     }
 
     if (!bt_enable(ble_ready)) {
+        perf_boot_mark(BOOT_BT_ENABLED);
         bt_conn_cb_register(&conn_callbacks);
         bt_conn_auth_cb_register(&auth_callbacks);
     } else {
@@ -215,19 +354,110 @@ struct settings_handler *get_paired_conf() {
     return &paired_conf;
 }
 
-bt_conn *ble_get_connection() { return connection; }
+bool ble_ready_to_send() { return atomic_get(&link_state) == BLE_LINK_READY; }
+
+bt_conn *ble_acquire_connection() {
+    k_spinlock_key_t key = k_spin_lock(&connection_lock);
+    bt_conn *conn = connection && ble_ready_to_send() ? bt_conn_ref(connection) : nullptr;
+    k_spin_unlock(&connection_lock, key);
+
+    return conn;
+}
+
+void ble_set_subscribed(bool subscribed) {
+    if (subscribed) {
+        set_link_flags(BLE_LINK_SUBSCRIBED);
+    } else {
+        clear_link_flags(BLE_LINK_SUBSCRIBED);
+    }
+}
+
+bool ble_wait_for_connection(k_timeout_t timeout) {
+    k_sem_reset(&connection_ready);
+    return ble_ready_to_send() || k_sem_take(&connection_ready, timeout) == 0;
+}
 
 void reset_paired_device() {
     LOG_INF("Disconnecting and unpairing stored paired device");
 
-    bt_unpair(BT_ID_DEFAULT, paired_addr.get());
+    if (has_paired_addr) {
+        bt_unpair(BT_ID_DEFAULT, &paired_addr);
+    }
     settings_delete("paired/one");
-    paired_addr = nullptr;
+    has_paired_addr = false;
 
-    if (connection) {
+    bt_conn *conn = reference_connection();
+    if (conn) {
         LOG_INF("Active connection was found. Disconnecting ...");
-        bt_conn_disconnect(connection, 0x13);
+        bt_conn_disconnect(conn, 0x13);
+        bt_conn_unref(conn);
     } else {
         k_work_submit(&advertise_work);
     }
-}
\ No newline at end of file
+}
+
+uint32_t ble_connection_generation() { return atomic_get(&connection_generation); }
+
+int ble_set_tx_power(int8_t dbm, bool connection_only, int8_t *selected_dbm) {
+    int err = 0;
+    if (!connection_only) {
+        // advertising set 0 is the only one, it keeps the level across restarts
+        err = write_tx_power(BT_HCI_VS_LL_HANDLE_TYPE_ADV, 0, dbm, selected_dbm);
+    }
+    if (!err) {
+        err = write_connection_tx_power(dbm, selected_dbm);
+    }
+
+    if (err) {
+        LOG_ERR("Setting TX power to %d dBm failed (%d)", dbm, err);
+        return err;
+    }
+
+    // only a level the controller took is handed to later connections
+    if (!connection_only) {
+        tx_power_dbm = dbm;
+    }
+    return 0;
+}
+
+int ble_read_rssi(int8_t *rssi) {
+    bt_conn *conn = reference_connection();
+    if (!conn) {
+        return -ENOTCONN;
+    }
+
+    uint16_t handle = 0;
+    int err = bt_hci_get_conn_handle(conn, &handle);
+    bt_conn_unref(conn);
+    if (err) {
+        return err;
+    }
+
+    struct net_buf *buf = bt_hci_cmd_create(BT_HCI_OP_READ_RSSI, sizeof(bt_hci_cp_read_rssi));
+    if (!buf) {
+        return -ENOBUFS;
+    }
+
+    auto *cp =
+        static_cast<bt_hci_cp_read_rssi *>(net_buf_add(buf, sizeof(bt_hci_cp_read_rssi)));
+    cp->handle = sys_cpu_to_le16(handle);
+
+    struct net_buf *rsp = nullptr;
+    err = bt_hci_cmd_send_sync(BT_HCI_OP_READ_RSSI, buf, &rsp);
+    if (err) {
+        return err;
+    }
+
+    *rssi = reinterpret_cast<bt_hci_rp_read_rssi *>(rsp->data)->rssi;
+    net_buf_unref(rsp);
+    return 0;
+}
+
+void ble_set_conn_params(const bt_le_conn_param &params) {
+    conn_params = params;
+    has_conn_params = true;
+
+    if (ble_ready_to_send()) {
+        k_work_submit(&conn_params_work);
+    }
+}
@@ -2,13 +2,76 @@
 #define BLE_CONNECTION_MANAGER
 
 #include <bluetooth/conn.h>
+#include <zephyr.h>
 
-#include <functional>
+typedef void (*ble_ready_callback)();
 
-void ble_init(std::function<void()> callback = nullptr);
+void ble_init(ble_ready_callback callback = nullptr);
 
 struct settings_handler *get_paired_conf();
-bt_conn *ble_get_connection();
+
+// connection state published to the scan loop, see ble_ready_to_send
+enum ble_link_flags {
+    BLE_LINK_CONNECTED = BIT(0),
+    BLE_LINK_SECURED = BIT(1),     // encrypted, at least BT_SECURITY_L2
+    BLE_LINK_SUBSCRIBED = BIT(2),  // host enabled notifications of an input report
+    BLE_LINK_READY = BLE_LINK_CONNECTED | BLE_LINK_SECURED | BLE_LINK_SUBSCRIBED
+};
+
+/**
+ * Returns whether the host is connected, the link is encrypted and input reports are subscribed.
+ * A single atomic load, cheap enough to check on every scan. The flags are cleared before the
+ * connection is released on disconnect, so the connection is never handed out while it is torn
+ * down.
+ */
+bool ble_ready_to_send();
+
+/**
+ * Returns a new reference to the connection if it is ready to send, nullptr otherwise. The caller
+ * owns the reference and has to release it with bt_conn_unref.
+ */
+bt_conn *ble_acquire_connection();
+
+/**
+ * Sets or clears BLE_LINK_SUBSCRIBED, called by the HID service when a CCC changes.
+ */
+void ble_set_subscribed(bool subscribed);
+
+/**
+ * Blocks until the connection is ready to send or the timeout expires, returns whether ready.
+ * Lets the disconnected main loop start scanning right after a (re)connect instead of finishing
+ * its polling delay first.
+ */
+bool ble_wait_for_connection(k_timeout_t timeout);
+
 void reset_paired_device();
 
+/**
+ * Returns a counter that is incremented on every established connection, so consumers can detect
+ * a reconnect they did not see the disconnect of.
+ */
+uint32_t ble_connection_generation();
+
+/**
+ * Sets the TX power of advertising and of the connection, later connections use it as well. With
+ * connection_only set, only the current connection changes. The controller picks the closest
+ * supported level, which is returned in dBm. Blocks on the HCI command, so it must not be called
+ * from the Bluetooth threads.
+ */
+int ble_set_tx_power(int8_t dbm, bool connection_only = false, int8_t *selected_dbm = nullptr);
+
+/**
+ * Reads the RSSI of the last packet received on the connection in dBm. Blocks on the HCI command
+ * like ble_set_tx_power.
+ *
+ * @return 0 on success, -ENOTCONN without connection
+ */
+int ble_read_rssi(int8_t *rssi);
+
+/**
+ * Requests new connection parameters from the host. Later connections request them as soon as
+ * they are encrypted, until then the defaults of CONFIG_BT_PERIPHERAL_PREF_* apply.
+ */
+void ble_set_conn_params(const bt_le_conn_param &params);
+
 #endif
\ No newline at end of file
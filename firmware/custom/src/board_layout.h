@@ -0,0 +1,15 @@
+#ifndef BOARD_LAYOUT
+#define BOARD_LAYOUT
+
+// matrix pins, port masks and default keymap of the board, generated from layouts/<board>.json at
+// configure time by tools/layout_gen.py
+
+#ifdef BOARD_AW_1
+#include "board_layout_aW_1.h"
+#endif
+
+#ifdef BOARD_FEATHER
+#include "board_layout_feather.h"
+#endif
+
+#endif
@@ -1,68 +1,50 @@
 #ifndef BOARD_MAPPINGS
 #define BOARD_MAPPINGS
 
-#include "keyboard_matrix_scanner.h"
-#include "keycode_resolver.h"
+#include "board_layout.h"
+#include "energy_counters.h"
+#include "keymap.h"
+#include "macro_player.h"
 #include "usb_hid_keys.h"
 
+// pins and the default keymap are generated from layouts/<board>.json, see board_layout.h
+
 // AW_1
 #ifdef BOARD_AW_1
 
-const keyboard_pins pins{
-    {0, 1, 2, 3, 4},              // rows_left
-    {6, 5, 4, 3, 2, 1, 0},        // columns_left
-    {16, 14, 12, 11, 10},         // rows_right
-    {15, 17, 19, 31, 30, 29, 28}  // columns_right
+const combo default_combos[] = {
+    {{{4, 5}, {4, 8}}, 2, KC(KEY_ESC)},  // both inner thumb keys
 };
 
-const dynamic_matrix<uint8_t> keycode_matrix{
-    {{KEY_ESC, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_GRAVE, 
-      KEY_BACKSPACE, KEY_6, KEY_7, KEY_8, KEY_9, KEY_0, KEY_MINUS},
-     {KEY_TAB, KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_SLASH, 
-      KEY_LEFTBRACE, KEY_Y, KEY_U, KEY_I, KEY_O, KEY_P, KEY_EQUAL},
-     {KEY_ENTER, KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_NONE, 
-      KEY_NONE, KEY_H, KEY_J, KEY_K, KEY_L, KEY_SEMICOLON, KEY_APOSTROPHE},
-     {KEY_LEFTSHIFT, KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B, KEY_BACKSLASH, 
-      KEY_RIGHTBRACE, KEY_N, KEY_M, KEY_COMMA, KEY_DOT, KEY_UP, KEY_RIGHTSHIFT},
-     {KEY_LEFTCTRL, KEY_LEFTALT, KEY_LEFTMETA, KEY_FN, KEY_INSERT, KEY_SPACE, KEY_NONE, 
-      KEY_NONE, KEY_SPACE, KEY_DELETE, KEY_RIGHTALT, KEY_LEFT, KEY_DOWN, KEY_RIGHT}}};
+// select all and copy
+const macro_step copy_all_macro[] = {MACRO_PRESS(KEY_LEFTCTRL), MACRO_TAP(KEY_A),
+                                     MACRO_TAP(KEY_C), MACRO_RELEASE(KEY_LEFTCTRL), MACRO_END};
 
-const dynamic_matrix<uint8_t> fn_matrix{
-    {{KEY_NONE, KEY_F1, KEY_F2, KEY_F3, KEY_F4, KEY_F5, KEY_MEDIA_MUTE, KEY_MEDIA_PLAYPAUSE, KEY_F6,
-      KEY_F7, KEY_F8, KEY_F9, KEY_F10, KEY_F11},
-     {KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_MEDIA_VOLUMEUP,
-      KEY_MEDIA_NEXTSONG, KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_F12},
-     {KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE,
-      KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE},
-     {KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_MEDIA_VOLUMEDOWN,
-      KEY_MEDIA_PREVIOUSSONG, KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_PAGEUP, KEY_NONE},
-     {KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE,
-      KEY_NONE, KEY_NONE, KEY_HOME, KEY_PAGEDOWN, KEY_END}}};
+const macro_step *const default_macros[] = {copy_all_macro};
 
-const uint8_t battery_reading_pin_analogue = 2;
-const uint16_t expander_i2c = 0x20;
-const uint8_t button_pin = 3;
+// nRF52832 data sheet values with the DC/DC converter and +4 dBm TX power. Sleep includes the
+// expander standby and battery divider currents, advertising uses the fast 30-60 ms interval and
+// connected idle the preferred 11.25 ms interval with a slave latency of 30.
+const energy_model board_energy_model{
+    {5, 180, 30, 3700, 7500, 1000},  // idle sleep, advertising, connected idle, scanning, TX, ADC
+    400,                              // encrypted 8 byte report incl. radio ramp up
+    80};                              // 3 byte register access at 400 kHz incl. pull-ups
 
 #endif
 
 // DEVELOPMENT BOARD
 #ifdef BOARD_FEATHER
-const keyboard_pins pins{
-    {0, 1},   // rows_left
-    {7, 6},   // columns_left
-    {2, 3},   // rows_right
-    {16, 15}  // columns_right
+
+const combo default_combos[] = {
+    {{{0, 0}, {0, 1}}, 2, KC(KEY_ESC)},
 };
 
-const dynamic_matrix<uint8_t> keycode_matrix{
-    {{KEY_A, KEY_B, KEY_C, KEY_D}, {KEY_LEFTSHIFT, KEY_E, KEY_F, KEY_G}}};
+const macro_step test_macro[] = {MACRO_TEXT("Hello, World!\n"), MACRO_END};
 
-const dynamic_matrix<uint8_t> fn_matrix{
-    {{KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE}, {KEY_NONE, KEY_NONE, KEY_NONE, KEY_NONE}}};
+const macro_step *const default_macros[] = {test_macro};
 
-const uint8_t battery_reading_pin_analogue = 7;
-const uint16_t expander_i2c = 0x20;
-const uint8_t button_pin = 27;
+// as aW_1, plus the quiescent current of the feather's regulator and USB UART
+const energy_model board_energy_model{{60, 235, 85, 3700, 7500, 1000}, 400, 80};
 
 #endif
 
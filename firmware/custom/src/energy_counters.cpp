@@ -0,0 +1,187 @@
+#include "energy_counters.h"
+
+#include <bluetooth/gatt.h>
+#include <logging/log.h>
+#include <shell/shell.h>
+
+#include "vendor_uuids.h"
+
+LOG_MODULE_REGISTER(energy);
+
+namespace {
+const energy_model *model = nullptr;
+energy_stats stats;
+energy_state radio_state = ENERGY_IDLE_SLEEP;
+int64_t radio_state_since_ms = 0;
+int64_t reset_at_ms = 0;
+uint16_t tx_current_permille = 1000;
+
+const char *const state_names[ENERGY_STATE_COUNT] = {
+    "idle_sleep", "advertising", "connected_idle", "scanning", "radio_tx", "adc_sampling"};
+
+// GATT representation of the statistics, durations in milliseconds
+struct energy_stats_record {
+    uint32_t elapsed_ms;
+    uint32_t state_ms[ENERGY_STATE_COUNT];
+    uint32_t events[ENERGY_EVENT_COUNT];
+    uint32_t average_current_ua;
+} __packed;
+
+energy_stats_record stats_record;
+
+struct bt_uuid_128 energy_service_uuid = VENDOR_UUID_INIT(VENDOR_UUID_ENERGY_SERVICE);
+struct bt_uuid_128 energy_stats_uuid = VENDOR_UUID_INIT(VENDOR_UUID_ENERGY_STATS);
+
+// needs irq_lock held
+void account_radio_tx(uint32_t airtime_us) {
+    stats.state_us[ENERGY_RADIO_TX] += airtime_us;
+    stats.radio_tx_weighted_us += static_cast<uint64_t>(airtime_us) * tx_current_permille / 1000;
+}
+
+// needs irq_lock held
+void account_radio_state(int64_t now_ms) {
+    stats.state_us[radio_state] += (now_ms - radio_state_since_ms) * 1000;
+    stats.elapsed_us = (now_ms - reset_at_ms) * 1000;
+    radio_state_since_ms = now_ms;
+}
+
+uint32_t average_current_ua(const energy_stats &snapshot) {
+    if (!model || snapshot.elapsed_us == 0) {
+        return 0;
+    }
+
+    // microamps times microseconds are picocoulombs, divided by the elapsed time again microamps
+    uint64_t charge_pc = 0;
+    for (uint8_t state = 0; state < ENERGY_STATE_COUNT; state++) {
+        const uint64_t state_us =
+            state == ENERGY_RADIO_TX ? snapshot.radio_tx_weighted_us : snapshot.state_us[state];
+        charge_pc += state_us * model->current_ua[state];
+    }
+    charge_pc += static_cast<uint64_t>(snapshot.events[ENERGY_EVENT_I2C_TRANSFER]) *
+                 model->i2c_transfer_nc * 1000;
+
+    return charge_pc / snapshot.elapsed_us;
+}
+
+ssize_t read_energy_stats(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf,
+                          uint16_t len, uint16_t offset) {
+    // take a fresh snapshot only at the start of a (long) read, so all parts are consistent
+    if (offset == 0) {
+        const energy_stats snapshot = energy_get();
+
+        stats_record.elapsed_ms = snapshot.elapsed_us / 1000;
+        for (uint8_t state = 0; state < ENERGY_STATE_COUNT; state++) {
+            stats_record.state_ms[state] = snapshot.state_us[state] / 1000;
+        }
+        for (uint8_t event = 0; event < ENERGY_EVENT_COUNT; event++) {
+            stats_record.events[event] = snapshot.events[event];
+        }
+        stats_record.average_current_ua = snapshot.average_current_ua;
+    }
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &stats_record, sizeof(stats_record));
+}
+
+ssize_t write_energy_stats(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+                           const void *buf, uint16_t len, uint16_t offset, uint8_t flags) {
+    // any write clears the statistics
+    energy_reset();
+    return len;
+}
+
+int cmd_energy_show(const struct shell *shell, size_t argc, char **argv) {
+    const energy_stats snapshot = energy_get();
+    const uint64_t elapsed_us = snapshot.elapsed_us ? snapshot.elapsed_us : 1;
+
+    shell_print(shell, "%-16s %12s %7s %10s", "state", "time [ms]", "share", "model [uA]");
+    for (uint8_t state = 0; state < ENERGY_STATE_COUNT; state++) {
+        const uint32_t permille = snapshot.state_us[state] * 1000 / elapsed_us;
+        shell_print(shell, "%-16s %12u %3u.%01u %% %10u", state_names[state],
+                    static_cast<uint32_t>(snapshot.state_us[state] / 1000), permille / 10,
+                    permille % 10, model ? model->current_ua[state] : 0);
+    }
+
+    shell_print(shell, "notifications: %u, i2c transfers: %u",
+                snapshot.events[ENERGY_EVENT_NOTIFY], snapshot.events[ENERGY_EVENT_I2C_TRANSFER]);
+    shell_print(shell, "average current: %u uA (%u.%03u mAh per hour) over %u s",
+                snapshot.average_current_ua, snapshot.average_current_ua / 1000,
+                snapshot.average_current_ua % 1000,
+                static_cast<uint32_t>(snapshot.elapsed_us / 1000000));
+    return 0;
+}
+
+int cmd_energy_reset(const struct shell *shell, size_t argc, char **argv) {
+    energy_reset();
+    shell_print(shell, "energy counters cleared");
+    return 0;
+}
+}  // namespace
+
+BT_GATT_SERVICE_DEFINE(energy_service, BT_GATT_PRIMARY_SERVICE(&energy_service_uuid),
+                       BT_GATT_CHARACTERISTIC(&energy_stats_uuid.uuid,
+                                              BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+                                              BT_GATT_PERM_READ | BT_GATT_PERM_WRITE_ENCRYPT,
+                                              read_energy_stats, write_energy_stats, nullptr));
+
+SHELL_STATIC_SUBCMD_SET_CREATE(energy_commands,
+                               SHELL_CMD(show, NULL, "Show time per power state and the estimated "
+                                                     "average current", cmd_energy_show),
+                               SHELL_CMD(reset, NULL, "Clear all energy counters",
+                                         cmd_energy_reset),
+                               SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(energy, &energy_commands, "Energy accounting per power state", NULL);
+
+void energy_init(const energy_model *model) {
+    ::model = model;
+    energy_reset();
+}
+
+void energy_set_radio_state(energy_state state) {
+    // sampled under the lock, so no later timestamp is accounted before this one
+    const unsigned int key = irq_lock();
+    const int64_t now_ms = k_uptime_get();
+    account_radio_state(now_ms);
+    radio_state = state;
+    irq_unlock(key);
+}
+
+void energy_set_tx_current_permille(uint16_t permille) { tx_current_permille = permille; }
+
+void energy_record(energy_state state, uint32_t microseconds) {
+    const unsigned int key = irq_lock();
+    if (state == ENERGY_RADIO_TX) {
+        account_radio_tx(microseconds);
+    } else {
+        stats.state_us[state] += microseconds;
+    }
+    irq_unlock(key);
+}
+
+void energy_count(energy_event event, uint32_t count) {
+    const unsigned int key = irq_lock();
+    stats.events[event] += count;
+    if (event == ENERGY_EVENT_NOTIFY && model) {
+        account_radio_tx(count * model->notify_airtime_us);
+    }
+    irq_unlock(key);
+}
+
+void energy_reset() {
+    const unsigned int key = irq_lock();
+    const int64_t now_ms = k_uptime_get();
+    stats = {};
+    reset_at_ms = now_ms;
+    radio_state_since_ms = now_ms;
+    irq_unlock(key);
+}
+
+energy_stats energy_get() {
+    const unsigned int key = irq_lock();
+    const int64_t now_ms = k_uptime_get();
+    account_radio_state(now_ms);
+    energy_stats snapshot = stats;
+    irq_unlock(key);
+
+    snapshot.average_current_ua = average_current_ua(snapshot);
+    return snapshot;
+}
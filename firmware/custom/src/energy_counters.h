@@ -0,0 +1,79 @@
+#ifndef ENERGY_COUNTERS
+#define ENERGY_COUNTERS
+
+#include <zephyr.h>
+
+/**
+ * Power states the firmware spends time in. The radio states are exclusive and together cover
+ * the whole uptime, the activity states overlap with them and only account the current drawn on
+ * top of the radio state.
+ */
+enum energy_state {
+    // radio states, see energy_set_radio_state
+    ENERGY_IDLE_SLEEP,      // neither advertising nor connected
+    ENERGY_ADVERTISING,
+    ENERGY_CONNECTED_IDLE,  // connected, including the empty connection events
+    // activity states
+    ENERGY_SCANNING,
+    ENERGY_RADIO_TX,  // estimated from the notifications sent, see energy_model::notify_airtime_us
+    ENERGY_ADC_SAMPLING,
+    ENERGY_STATE_COUNT
+};
+
+enum energy_event { ENERGY_EVENT_NOTIFY, ENERGY_EVENT_I2C_TRANSFER, ENERGY_EVENT_COUNT };
+
+/**
+ * Current model of a board, measured or taken from the data sheets. The average currents of the
+ * radio states include the sleep current, the activity currents are on top of the radio state.
+ */
+typedef struct energy_model {
+    uint16_t current_ua[ENERGY_STATE_COUNT];
+    uint16_t notify_airtime_us;  // radio on time per notification
+    uint16_t i2c_transfer_nc;    // charge of a single I2C transfer beyond the CPU active time
+} energy_model;
+
+typedef struct energy_stats {
+    uint64_t elapsed_us;
+    uint64_t state_us[ENERGY_STATE_COUNT];
+    uint32_t events[ENERGY_EVENT_COUNT];
+    uint64_t radio_tx_weighted_us;  // TX airtime scaled by the current at the TX power in use
+    uint32_t average_current_ua;    // estimated from the time in each state and the current model
+} energy_stats;
+
+/**
+ * Sets the current model and clears all statistics. Needs to be called once at boot.
+ */
+void energy_init(const energy_model *model);
+
+/**
+ * Switches the exclusive radio state, the time since the last switch is accounted to the previous
+ * state. Only ENERGY_IDLE_SLEEP, ENERGY_ADVERTISING and ENERGY_CONNECTED_IDLE are radio states.
+ */
+void energy_set_radio_state(energy_state state);
+
+/**
+ * Sets the radio current at the active TX power relative to ENERGY_RADIO_TX of the model, in
+ * permille. The airtime of notifications stays as sent, only the current estimate is scaled.
+ */
+void energy_set_tx_current_permille(uint16_t permille);
+
+void energy_record(energy_state state, uint32_t microseconds);
+void energy_count(energy_event event, uint32_t count = 1);
+void energy_reset();
+energy_stats energy_get();
+
+/**
+ * Records the wall clock time between construction and destruction of the scope to an activity
+ * state. Unlike PerfScope this includes the time the CPU sleeps waiting for a peripheral.
+ */
+class EnergyScope {
+   private:
+    const energy_state state;
+    const uint32_t start;
+
+   public:
+    explicit EnergyScope(energy_state state) : state{state}, start{k_cycle_get_32()} {}
+    ~EnergyScope() { energy_record(state, k_cyc_to_us_floor32(k_cycle_get_32() - start)); }
+};
+
+#endif
@@ -0,0 +1,59 @@
+#include "event_trace.h"
+
+#include <shell/shell.h>
+
+#include <array>
+
+namespace {
+// needs to be a power of two
+const uint16_t trace_capacity = 128;
+
+std::array<trace_record, trace_capacity> records;
+uint32_t next_record = 0;
+volatile bool recording = true;
+
+int cmd_trace_dump(const struct shell *shell, size_t argc, char **argv) {
+    const unsigned int key = irq_lock();
+    const uint32_t end = next_record;
+    irq_unlock(key);
+
+    const uint32_t start = end > trace_capacity ? end - trace_capacity : 0;
+
+    // raw records, decode with tools/trace_decode.py
+    shell_print(shell, "trace %u %u", CONFIG_SYS_CLOCK_HW_CYCLES_PER_SEC, end - start);
+    for (uint32_t index = start; index < end; index++) {
+        const trace_record &record = records[index & (trace_capacity - 1)];
+        shell_print(shell, "%08x %04x %04x %08x", record.timestamp, record.event, record.arg0,
+                    record.arg1);
+    }
+
+    return 0;
+}
+
+int cmd_trace_clear(const struct shell *shell, size_t argc, char **argv) {
+    const unsigned int key = irq_lock();
+    next_record = 0;
+    irq_unlock(key);
+
+    return 0;
+}
+}  // namespace
+
+SHELL_STATIC_SUBCMD_SET_CREATE(trace_commands,
+                               SHELL_CMD(dump, NULL, "Dump raw trace records", cmd_trace_dump),
+                               SHELL_CMD(clear, NULL, "Clear the trace buffer", cmd_trace_clear),
+                               SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(trace, &trace_commands, "Binary event trace", NULL);
+
+void trace(trace_event event, uint16_t arg0, uint32_t arg1) {
+    if (!recording) {
+        return;
+    }
+
+    const unsigned int key = irq_lock();
+    records[next_record & (trace_capacity - 1)] = {k_cycle_get_32(), event, arg0, arg1};
+    next_record++;
+    irq_unlock(key);
+}
+
+void trace_set_recording(bool enabled) { recording = enabled; }
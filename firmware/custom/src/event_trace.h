@@ -0,0 +1,62 @@
+#ifndef EVENT_TRACE
+#define EVENT_TRACE
+
+#include <zephyr.h>
+
+/**
+ * Event ids of the binary trace. Append only, the ids are decoded offline by
+ * tools/trace_decode.py.
+ */
+enum trace_event : uint16_t {
+    TRACE_SCAN = 0x01,                // arg0: pressed keys, arg1: scan cycles
+    TRACE_KEY_DOWN = 0x02,            // arg0: row, arg1: column
+    TRACE_KEY_UP = 0x03,              // arg0: row, arg1: column
+    TRACE_NOTIFY_KEYS = 0x04,         // arg0: keycodes, arg1: modifier bitmask
+    TRACE_NOTIFY_RELEASE = 0x05,
+    TRACE_NOTIFY_FAILED = 0x06,       // arg1: error
+    TRACE_TAP_HOLD = 0x07,            // arg0: 1 if hold, arg1: milliseconds until decided
+    TRACE_MACRO_START = 0x08,         // arg0: macro
+    TRACE_MACRO_END = 0x09,           // arg0: macro, arg1: 1 if interrupted
+    TRACE_BUFFER_FLUSH = 0x0A,        // arg0: buffered entries sent, arg1: stale entries dropped
+    TRACE_SCAN_RATE = 0x0B,           // arg0: scan_rate, arg1: polling delay in milliseconds
+    TRACE_STUCK_KEY = 0x0C,           // arg0: row, arg1: column
+    TRACE_STUCK_KEY_RELEASED = 0x0D,  // arg0: row, arg1: column
+    TRACE_CONNECTED = 0x10,           // arg0: error
+    TRACE_DISCONNECTED = 0x11,        // arg0: reason
+    TRACE_SECURITY_CHANGED = 0x12,    // arg0: level, arg1: error
+    TRACE_PARAMS_UPDATED = 0x13,      // arg0: interval, arg1: latency
+    TRACE_CCC_CHANGED = 0x14,         // arg0: attribute index, arg1: value
+    TRACE_BOOT_PHASE = 0x15,          // arg0: boot_phase, arg1: microseconds since boot
+    TRACE_TX_POWER = 0x16,            // arg0: dBm, arg1: filtered RSSI in dBm
+    TRACE_BATTERY_VOLTAGE = 0x20,     // arg0: millivolts
+    TRACE_POWER_PROFILE = 0x21,       // arg0: power_profile, arg1: battery level
+    TRACE_ERROR = 0x30,               // arg0: trace_error, arg1: error code
+};
+
+enum trace_error : uint16_t {
+    TRACE_ERROR_ADC = 0x01,
+    TRACE_ERROR_ADVERTISING = 0x02,
+    TRACE_ERROR_PAIRING = 0x03,
+    TRACE_ERROR_SECURITY = 0x04,
+};
+
+typedef struct trace_record {
+    uint32_t timestamp;  // hardware cycles, see CONFIG_SYS_CLOCK_HW_CYCLES_PER_SEC
+    uint16_t event;
+    uint16_t arg0;
+    uint32_t arg1;
+} trace_record;
+
+/**
+ * Appends a fixed size record to the in-RAM trace ring buffer, overwriting the oldest record once
+ * the buffer is full. Cheap enough for the scan loop and safe to call from any thread.
+ */
+void trace(trace_event event, uint16_t arg0 = 0, uint32_t arg1 = 0);
+
+/**
+ * Stops or resumes appending records, e.g. while benchmarks run the traced paths. Records are
+ * dropped while stopped.
+ */
+void trace_set_recording(bool enabled);
+
+#endif
@@ -13,8 +13,14 @@
 #include <zephyr/types.h>
 #include <logging/log.h>
 
+#include <algorithm>
 #include <array>
-#include <string>
+
+#include "ble_connection_manager.h"
+#include "energy_counters.h"
+#include "event_trace.h"
+#include "perf_counters.h"
+#include "uart_transport.h"
 
 LOG_MODULE_REGISTER(hid);
 
@@ -103,42 +109,52 @@ static uint8_t report_map[]{
 
 static ssize_t read_hid_info(struct bt_conn* conn, const struct bt_gatt_attr* attr, void* buf,
                              uint16_t len, uint16_t offset) {
-    LOG_INF("reading HID info");
+    LOG_DBG("reading HID info");
     return bt_gatt_attr_read(conn, attr, buf, len, offset, attr->user_data,
                              sizeof(struct hids_info));
 }
 
 static ssize_t read_report_map(struct bt_conn* conn, const struct bt_gatt_attr* attr, void* buf,
                                uint16_t len, uint16_t offset) {
-    LOG_INF("reading report map");
+    LOG_DBG("reading report map");
     return bt_gatt_attr_read(conn, attr, buf, len, offset, report_map, sizeof(report_map));
 }
 
 static ssize_t read_input_report_descriptor(struct bt_conn* conn, const struct bt_gatt_attr* attr,
                                             void* buf, uint16_t len, uint16_t offset) {
-    LOG_INF("reading input report descriptor");
+    LOG_DBG("reading input report descriptor");
     return bt_gatt_attr_read(conn, attr, buf, len, offset, attr->user_data,
                              sizeof(struct hids_report));
 }
 
 static ssize_t read_output_report_descriptor(struct bt_conn* conn, const struct bt_gatt_attr* attr,
                                              void* buf, uint16_t len, uint16_t offset) {
-    LOG_INF("reading output report descriptor");
+    LOG_DBG("reading output report descriptor");
     return bt_gatt_attr_read(conn, attr, buf, len, offset, attr->user_data,
                              sizeof(struct hids_report));
 }
 
+// either input report counts as subscribed, the protocol mode decides which one is notified
+static bool input_subscribed = false;
+static bool boot_input_subscribed = false;
+
 static void input_ccc_changed(const struct bt_gatt_attr* attr, uint16_t value) {
+    trace(TRACE_CCC_CHANGED, 4, value);
+    input_subscribed = value == BT_GATT_CCC_NOTIFY;
+    ble_set_subscribed(input_subscribed || boot_input_subscribed);
     LOG_INF("Input CCC changed: notify %s", (value == BT_GATT_CCC_NOTIFY) ? "true" : "false");
 }
 
 static void boot_input_ccc_changed(const struct bt_gatt_attr* attr, uint16_t value) {
+    trace(TRACE_CCC_CHANGED, 13, value);
+    boot_input_subscribed = value == BT_GATT_CCC_NOTIFY;
+    ble_set_subscribed(input_subscribed || boot_input_subscribed);
     LOG_INF("Boot Input CCC changed: notify %s", (value == BT_GATT_CCC_NOTIFY) ? "true" : "false");
 }
 
 static ssize_t write_ctrl_point(struct bt_conn* conn, const struct bt_gatt_attr* attr,
                                 const void* buf, uint16_t len, uint16_t offset, uint8_t flags) {
-    LOG_INF("writing control point");
+    LOG_DBG("writing control point");
     uint8_t* value = static_cast<uint8_t*>(attr->user_data);
 
     if (offset + len > sizeof(ctrl_point)) {
@@ -152,13 +168,13 @@ static ssize_t write_ctrl_point(struct bt_conn* conn, const struct bt_gatt_attr*
 
 static ssize_t read_protocol_mode(struct bt_conn* conn, const struct bt_gatt_attr* attr, void* buf,
                                   uint16_t len, uint16_t offset) {
-    LOG_INF("reading protocol mode");
+    LOG_DBG("reading protocol mode");
     return bt_gatt_attr_read(conn, attr, buf, len, offset, attr->user_data, sizeof(protocol_mode));
 }
 
 static ssize_t write_protocol_mode(struct bt_conn* conn, const struct bt_gatt_attr* attr,
                                    const void* buf, uint16_t len, uint16_t offset, uint8_t flags) {
-    LOG_INF("writing protocol mode");
+    LOG_DBG("writing protocol mode");
     uint8_t* value = static_cast<uint8_t*>(attr->user_data);
 
     if (offset + len > sizeof(protocol_mode)) {
@@ -172,19 +188,19 @@ static ssize_t write_protocol_mode(struct bt_conn* conn, const struct bt_gatt_at
 
 static ssize_t read_input_report(struct bt_conn* conn, const struct bt_gatt_attr* attr, void* buf,
                                  uint16_t len, uint16_t offset) {
-    LOG_INF("reading input report");
+    LOG_DBG("reading input report");
     return bt_gatt_attr_read(conn, attr, buf, len, offset, attr->user_data, sizeof(input_report));
 }
 
 static ssize_t read_output_report(struct bt_conn* conn, const struct bt_gatt_attr* attr, void* buf,
                                   uint16_t len, uint16_t offset) {
-    LOG_INF("reading output report");
+    LOG_DBG("reading output report");
     return bt_gatt_attr_read(conn, attr, buf, len, offset, attr->user_data, sizeof(output_report));
 }
 
 static ssize_t write_output_report(struct bt_conn* conn, const struct bt_gatt_attr* attr,
                                    const void* buf, uint16_t len, uint16_t offset, uint8_t flags) {
-    LOG_INF("writing output report");
+    LOG_DBG("writing output report");
     uint8_t* value = static_cast<uint8_t*>(attr->user_data);
 
     if (offset + len > sizeof(protocol_mode)) {
@@ -228,42 +244,261 @@ BT_GATT_SERVICE_DEFINE(
     BT_GATT_CHARACTERISTIC(BT_UUID_HIDS_CTRL_POINT, BT_GATT_CHRC_WRITE_WITHOUT_RESP,
                            BT_GATT_PERM_WRITE, NULL, write_ctrl_point, &ctrl_point));
 
-void notify_keycodes(bt_conn* conn, std::vector<uint8_t> keycodes, std::vector<uint8_t> modifiers) {
-    LOG_INF("notifying %d keys and %d modifiers", keycodes.size(), modifiers.size());
+namespace {
+// needs to be a power of two
+const uint8_t report_queue_capacity = 16;
+// notifications handed to the stack but not yet completed, one per L2CAP TX buffer
+const uint8_t max_reports_in_flight = 3;
+// connection intervals without a completed notification after which the window is reopened
+const uint8_t stall_intervals = 8;
+// completions later than this many connection intervals (in quarters) needed a retransmission
+const uint8_t slow_completion_quarters = 10;
+
+std::array<std::array<uint8_t, 8>, report_queue_capacity> report_queue;
+uint32_t queue_head = 0;
+uint32_t queue_tail = 0;
+uint8_t reports_in_flight = 0;
+uint32_t last_progress = 0;
+// hardware cycles at which each in-flight notification was handed to the stack, oldest first. A
+// power of two, so the indices can wrap.
+std::array<uint32_t, 4> sent_cycles;
+uint8_t sent_head = 0;
+uint8_t sent_tail = 0;
+uint32_t interval_us = 0;
+hid_link_stats link_stats;
+// referenced while reports are queued for it, released on disconnect
+bt_conn* report_conn = nullptr;
+struct k_spinlock report_lock;
+
+void send_reports(struct k_work* work);
+K_WORK_DEFINE(send_work, send_reports);
+
+void report_sent(struct bt_conn* conn, void* user_data) {
+    const uint32_t now = k_cycle_get_32();
+
+    k_spinlock_key_t key = k_spin_lock(&report_lock);
+    if (reports_in_flight > 0) {
+        reports_in_flight--;
+    }
+    last_progress = k_uptime_get_32();
+
+    if (sent_tail != sent_head) {
+        const uint32_t latency_us =
+            k_cyc_to_us_floor32(now - sent_cycles[sent_tail & (sent_cycles.size() - 1)]);
+        sent_tail++;
+
+        link_stats.completed++;
+        link_stats.last_completion_cycles = now;
+        link_stats.last_latency_us = latency_us;
+        link_stats.interval_us = interval_us;
+        if (interval_us && latency_us * 4 > interval_us * slow_completion_quarters) {
+            link_stats.slow_completions++;
+        }
+    }
+    k_spin_unlock(&report_lock, key);
+
+    k_work_submit(&send_work);
+}
+
+// 0 if unknown
+uint32_t connection_interval_us(bt_conn* conn) {
+    struct bt_conn_info info;
+    if (!conn || bt_conn_get_info(conn, &info)) {
+        return 0;
+    }
+
+    // interval is in units of 1.25 ms
+    return info.le.interval * 1250;
+}
+
+/**
+ * Sends queued reports in order while the in-flight window allows it. Runs on the system
+ * workqueue and is resubmitted by every completed notification, so reports go out as fast as the
+ * link acknowledges them without ever exhausting the stack's TX buffers.
+ */
+void send_reports(struct k_work* work) {
+    while (true) {
+        k_spinlock_key_t key = k_spin_lock(&report_lock);
+
+        // a link being torn down keeps its reports queued until hid_disconnected drops them
+        if (queue_head == queue_tail || !report_conn || !ble_ready_to_send()) {
+            k_spin_unlock(&report_lock, key);
+            return;
+        }
+
+        bt_conn* conn = bt_conn_ref(report_conn);
+        k_spin_unlock(&report_lock, key);
+        const uint32_t conn_interval_us = connection_interval_us(conn);
+        const uint32_t stall_timeout =
+            conn_interval_us ? stall_intervals * conn_interval_us / 1000 : 1000;
+
+        key = k_spin_lock(&report_lock);
+        interval_us = conn_interval_us;
+        if (reports_in_flight >= max_reports_in_flight &&
+            k_uptime_get_32() - last_progress > stall_timeout) {
+            // completions got lost, e.g. across a disconnect
+            reports_in_flight = 0;
+            sent_tail = sent_head;
+        }
+
+        if (queue_head == queue_tail || reports_in_flight >= max_reports_in_flight) {
+            k_spin_unlock(&report_lock, key);
+            bt_conn_unref(conn);
+            return;
+        }
+
+        const std::array<uint8_t, 8> report = report_queue[queue_tail & (report_queue_capacity - 1)];
+        reports_in_flight++;
+        sent_cycles[sent_head++ & (sent_cycles.size() - 1)] = k_cycle_get_32();
+        k_spin_unlock(&report_lock, key);
+
+        struct bt_gatt_notify_params params = {};
+        params.attr = protocol_mode == 0x01 ? &hid_keyboard_service.attrs[4]
+                                            : &hid_keyboard_service.attrs[13];
+        params.data = report.data();
+        params.len = report.size();
+        params.func = report_sent;
+        const int err = bt_gatt_notify_cb(conn, &params);
+        bt_conn_unref(conn);
+
+        key = k_spin_lock(&report_lock);
+        if (err) {
+            reports_in_flight--;
+            sent_head--;
+        }
+        // out of buffers is retried on the next completion, anything else drops the report
+        if (err != -ENOMEM) {
+            queue_tail++;
+            last_progress = k_uptime_get_32();
+        }
+        k_spin_unlock(&report_lock, key);
+
+        if (err) {
+            trace(TRACE_NOTIFY_FAILED, 0, err);
+            if (err == -ENOMEM) {
+                return;
+            }
+        } else {
+            memcpy(input_report, report.data(), report.size());
+            energy_count(ENERGY_EVENT_NOTIFY);
+        }
+    }
+}
+
+int queue_report(bt_conn* conn, const std::array<uint8_t, 8>& report) {
+    if (!conn) {
+        return -ENOTCONN;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&report_lock);
+    if (queue_head - queue_tail >= report_queue_capacity) {
+        k_spin_unlock(&report_lock, key);
+        trace(TRACE_NOTIFY_FAILED, 0, -ENOBUFS);
+        return -ENOBUFS;
+    }
+
+    report_queue[queue_head & (report_queue_capacity - 1)] = report;
+    queue_head++;
+    bt_conn* replaced = nullptr;
+    if (report_conn != conn) {
+        replaced = report_conn;
+        report_conn = bt_conn_ref(conn);
+    }
+    k_spin_unlock(&report_lock, key);
+
+    if (replaced) {
+        bt_conn_unref(replaced);
+    }
+
+    k_work_submit(&send_work);
+    return 0;
+}
+
+void hid_disconnected(struct bt_conn* conn, uint8_t reason) {
+    k_spinlock_key_t key = k_spin_lock(&report_lock);
+    queue_tail = queue_head;
+    reports_in_flight = 0;
+    sent_tail = sent_head;
+    bt_conn* released = report_conn;
+    report_conn = nullptr;
+    k_spin_unlock(&report_lock, key);
+
+    if (released) {
+        bt_conn_unref(released);
+    }
+
+    // the connection manager clears its link state, bonded hosts are subscribed again on reconnect
+    input_subscribed = false;
+    boot_input_subscribed = false;
+}
+
+struct bt_conn_cb hid_conn_callbacks = {.disconnected = hid_disconnected};
+
+int send_uart_report(bt_conn* conn, const std::array<uint8_t, 8>& report) {
+    return uart_transport_send_report(report.data(), report.size());
+}
+
+bool uart_ready() { return true; }
+
+typedef struct report_transport {
+    int (*send)(bt_conn* conn, const std::array<uint8_t, 8>& report);
+    bool (*ready)();
+} report_transport;
+
+const report_transport transports[HID_TRANSPORT_COUNT] = {
+    {queue_report, ble_ready_to_send},
+    {send_uart_report, uart_ready},
+};
+
+volatile hid_transport active_transport = HID_TRANSPORT_BLE;
+}  // namespace
+
+int notify_keycodes(bt_conn* conn, const key_list& keycodes, const key_list& modifiers) {
+    PerfScope perf_scope{PERF_NOTIFY_KEYCODES};
     uint8_t modifiers_bitmask = convert_modifiers_to_bitmask(modifiers);
+    trace(TRACE_NOTIFY_KEYS, keycodes.size(), modifiers_bitmask);
 
     std::array<uint8_t, 8> data{modifiers_bitmask, 0x00};
 
-    auto last = std::min(keycodes.size(), 5u);
+    auto last = std::min<size_t>(keycodes.size(), 6);
     std::copy(keycodes.begin(), keycodes.begin() + last, data.begin() + 2);
 
-    int err = 0;
-    if (protocol_mode == 0x01) {
-        LOG_INF("notifying to regular report map attribute");
-        err = bt_gatt_notify(conn, &hid_keyboard_service.attrs[4], &data[0], 8);
-    } else {
-        LOG_INF("notifying to boot report map attribute");
-        err = bt_gatt_notify(conn, &hid_keyboard_service.attrs[13], &data[0], 8);
-    }
+    return transports[active_transport].send(conn, data);
+}
 
-    if (err) {
-        LOG_ERR("notify failed!");
-    }
+int notify_keyrelease(bt_conn* conn) {
+    trace(TRACE_NOTIFY_RELEASE);
+    return transports[active_transport].send(conn, {});
 }
 
-void notify_keyrelease(bt_conn* conn) {
-    LOG_INF("notifying keyrelease");
-    uint8_t keyrelease_data[8] = {0x00};
-    if (protocol_mode == 0x01) {
-        LOG_INF("notifying to regular report map attribute");
-        bt_gatt_notify(conn, &hid_keyboard_service.attrs[4], &keyrelease_data, 8);
-    } else {
-        LOG_INF("notifying to boot report map attribute");
-        bt_gatt_notify(conn, &hid_keyboard_service.attrs[13], &keyrelease_data, 8);
+size_t hid_report_queue_space() {
+    if (active_transport == HID_TRANSPORT_UART) {
+        // written synchronously, never full
+        return report_queue_capacity;
     }
+
+    k_spinlock_key_t key = k_spin_lock(&report_lock);
+    const size_t space = report_queue_capacity - (queue_head - queue_tail);
+    k_spin_unlock(&report_lock, key);
+
+    return space;
+}
+
+size_t hid_report_queue_depth() {
+    k_spinlock_key_t key = k_spin_lock(&report_lock);
+    const size_t depth = queue_head - queue_tail;
+    k_spin_unlock(&report_lock, key);
+
+    return depth;
+}
+
+void hid_drop_queued_reports() {
+    k_spinlock_key_t key = k_spin_lock(&report_lock);
+    queue_tail = queue_head;
+    k_spin_unlock(&report_lock, key);
 }
 
-uint8_t convert_modifiers_to_bitmask(std::vector<uint8_t> modifiers) {
+uint8_t convert_modifiers_to_bitmask(const key_list& modifiers) {
     uint8_t bitmask = 0x00;
 
     for (auto modifier : modifiers) {
@@ -289,4 +524,26 @@ uint8_t convert_modifiers_to_bitmask(std::vector<uint8_t> modifiers) {
     return bitmask;
 }
 
-void hid_init(void) {}
+void hid_init(void) { bt_conn_cb_register(&hid_conn_callbacks); }
+
+hid_link_stats hid_get_link_stats() {
+    k_spinlock_key_t key = k_spin_lock(&report_lock);
+    const hid_link_stats stats = link_stats;
+    k_spin_unlock(&report_lock, key);
+
+    return stats;
+}
+
+void hid_set_transport(hid_transport transport) {
+    if (transport == active_transport) {
+        return;
+    }
+
+    LOG_INF("Sending reports over %s", transport == HID_TRANSPORT_UART ? "uart" : "ble");
+    hid_drop_queued_reports();
+    active_transport = transport;
+}
+
+hid_transport hid_get_transport() { return active_transport; }
+
+bool hid_transport_ready() { return transports[active_transport].ready(); }
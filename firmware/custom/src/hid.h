@@ -3,14 +3,72 @@
 
 #include <bluetooth/conn.h>
 
-#include <vector>
+#include "static_vector.h"
+
+// keycodes or modifiers of a report, only the first six keycodes are sent
+typedef StaticVector<uint8_t, 8> key_list;
 
 void hid_init(void);
 
-void notify_keycodes(bt_conn *conn, std::vector<uint8_t> keycodes, std::vector<uint8_t> modifiers);
+/**
+ * Queue a keyboard report. Queued reports are notified in order, paced by completed notifications
+ * so they never overflow the BLE TX buffers.
+ *
+ * @return 0 on success, -ENOBUFS if the report queue is full, -ENOTCONN without connection
+ */
+int notify_keycodes(bt_conn *conn, const key_list &keycodes, const key_list &modifiers);
+
+int notify_keyrelease(bt_conn *conn);
+
+/**
+ * Returns the number of reports that can be queued without failing.
+ */
+size_t hid_report_queue_space();
+
+/**
+ * Returns the number of reports queued but not yet handed to the stack. Always 0 on the UART
+ * transport, it writes reports synchronously.
+ */
+size_t hid_report_queue_depth();
+
+/**
+ * Drops all reports that were queued but not yet handed to the stack.
+ */
+void hid_drop_queued_reports();
+
+enum hid_transport : uint8_t {
+    HID_TRANSPORT_BLE,   // notifications of the HID service, the default
+    HID_TRANSPORT_UART,  // frames on the console UART, see uart_transport.h
+    HID_TRANSPORT_COUNT
+};
+
+/**
+ * Selects where notify_keycodes and notify_keyrelease send reports to. Reports still queued for
+ * the previous transport are dropped. The connection passed to them is ignored by the UART.
+ */
+void hid_set_transport(hid_transport transport);
+
+hid_transport hid_get_transport();
+
+/**
+ * Returns whether reports can be sent: the BLE link is ready, the UART always is.
+ */
+bool hid_transport_ready();
+
+uint8_t convert_modifiers_to_bitmask(const key_list &modifiers);
 
-void notify_keyrelease(bt_conn *conn);
+typedef struct hid_link_stats {
+    uint32_t completed;               // notifications acknowledged by the host
+    uint32_t slow_completions;        // acknowledged 2.5 connection intervals or later
+    uint32_t last_completion_cycles;  // hardware cycles of the last acknowledgement
+    uint32_t last_latency_us;         // from handing the last notification to the stack to its ack
+    uint32_t interval_us;             // connection interval of the last acknowledgement
+} hid_link_stats;
 
-uint8_t convert_modifiers_to_bitmask(std::vector<uint8_t> modifiers);
+/**
+ * Returns the running totals of acknowledged notifications. Slow completions mostly mean the
+ * notification had to be retransmitted.
+ */
+hid_link_stats hid_get_link_stats();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,141 @@
+#include "io_expander.h"
+
+#include <drivers/i2c.h>
+
+#include "energy_counters.h"
+
+namespace {
+const uint8_t settle_rounds = 8;
+// rows slower than this are treated as broken rather than waited for on every strobe
+const uint32_t max_settle_us = 200;
+}  // namespace
+
+int I2cExpander::write_register(uint8_t reg, uint8_t value) {
+    energy_count(ENERGY_EVENT_I2C_TRANSFER);
+    return i2c_reg_write_byte(i2c, address, reg, value);
+}
+
+int I2cExpander::read_register(uint8_t reg, uint8_t *value) {
+    energy_count(ENERGY_EVENT_I2C_TRANSFER);
+    return i2c_reg_read_byte(i2c, address, reg, value);
+}
+
+int I2cExpander::select_columns(uint8_t direction_reg, uint8_t column_mask) {
+    // selected columns are outputs, their latches are low since init
+    const uint8_t direction = ~column_mask;
+    if (column_direction_valid && column_direction == direction) {
+        return 0;
+    }
+
+    const int err = write_register(direction_reg, direction);
+    column_direction = direction;
+    column_direction_valid = err == 0;
+    if (settle_us) {
+        k_busy_wait(settle_us);
+    }
+    return err;
+}
+
+int I2cExpander::scan_columns(uint8_t direction_reg, uint8_t input_reg,
+                              const uint8_t *column_pins, uint8_t count, uint8_t *rows) {
+    uint8_t direction_write[2] = {direction_reg, 0};
+    struct i2c_msg msgs[3] = {
+        {.buf = direction_write, .len = sizeof(direction_write), .flags = I2C_MSG_WRITE},
+        {.buf = &input_reg, .len = 1, .flags = I2C_MSG_WRITE | I2C_MSG_RESTART},
+        {.buf = nullptr, .len = 1, .flags = I2C_MSG_READ | I2C_MSG_RESTART | I2C_MSG_STOP},
+    };
+
+    column_direction_valid = false;
+#pragma GCC unroll 8
+    for (uint8_t column = 0; column < count; column++) {
+        direction_write[1] = ~(1 << column_pins[column]);
+        msgs[2].buf = &rows[column];
+
+        energy_count(ENERGY_EVENT_I2C_TRANSFER);
+        int err;
+        if (settle_us) {
+            // the rows need longer than a combined transaction, release the bus meanwhile
+            err = i2c_write(i2c, direction_write, sizeof(direction_write), address);
+            k_busy_wait(settle_us);
+            energy_count(ENERGY_EVENT_I2C_TRANSFER);
+            err = err ? err : i2c_write_read(i2c, address, &input_reg, 1, &rows[column], 1);
+        } else {
+            err = i2c_transfer(i2c, msgs, 3, address);
+        }
+        if (err) {
+            return err;
+        }
+    }
+
+    if (count > 0) {
+        column_direction = direction_write[1];
+        column_direction_valid = true;
+    }
+    return 0;
+}
+
+int I2cExpander::calibrate_settle(uint8_t row_direction_reg, uint8_t row_output_reg,
+                                  uint8_t input_reg, uint8_t row_mask) {
+    // the rows are driven low and released like by a column strobe, then read back the way
+    // scan_columns does. Columns stay released, so held keys do not matter.
+    uint8_t release_rows[2] = {row_direction_reg, 0xFF};
+    uint8_t rows = 0;
+    struct i2c_msg msgs[3] = {
+        {.buf = release_rows, .len = sizeof(release_rows), .flags = I2C_MSG_WRITE},
+        {.buf = &input_reg, .len = 1, .flags = I2C_MSG_WRITE | I2C_MSG_RESTART},
+        {.buf = &rows, .len = 1, .flags = I2C_MSG_READ | I2C_MSG_RESTART | I2C_MSG_STOP},
+    };
+
+    uint32_t slowest_us = 0;
+    int err = write_register(row_output_reg, 0x00);
+    for (uint8_t round = 0; !err && round < settle_rounds; round++) {
+        err = write_register(row_direction_reg, 0x00);
+        if (err) {
+            break;
+        }
+
+        energy_count(ENERGY_EVENT_I2C_TRANSFER);
+        err = i2c_transfer(i2c, msgs, 3, address);
+        const uint32_t start = k_cycle_get_32();
+        uint32_t waited_us = 0;
+        // rows read back inverted, a row still low reads as 1
+        while (!err && (rows & row_mask) && waited_us <= max_settle_us) {
+            err = read_register(input_reg, &rows);
+            waited_us = k_cyc_to_us_floor32(k_cycle_get_32() - start);
+        }
+        slowest_us = MAX(slowest_us, waited_us);
+    }
+
+    if (err) {
+        return err;
+    }
+
+    // twice the slowest rise as margin, reads are only as fine as an I2C transaction anyway
+    settle_us = MIN(2 * slowest_us, max_settle_us);
+    return 0;
+}
+
+bool Mcp23017::init(device *i2c, uint16_t address) {
+    this->i2c = i2c;
+    this->address = address;
+    column_direction_valid = false;
+
+    return write_register(0x05, 0x00) == 0 &&  // reset settings
+           write_register(iodirb, 0xFF) == 0 &&  // rows inputs
+           write_register(ipolb, 0xFF) == 0 &&  // invert rows
+           write_register(gppub, 0xFF) == 0 &&  // row pull-ups
+           write_register(iodira, 0xFF) == 0 &&  // cols inputs
+           write_register(gppua, 0x00) == 0 &&  // no col pull-ups
+           write_register(gpioa, 0x00) == 0;  // col latches low
+}
+
+bool Pca9555::init(device *i2c, uint16_t address) {
+    this->i2c = i2c;
+    this->address = address;
+    column_direction_valid = false;
+
+    return write_register(config1, 0xFF) == 0 &&  // rows inputs
+           write_register(polarity1, 0xFF) == 0 &&  // invert rows
+           write_register(config0, 0xFF) == 0 &&  // cols inputs
+           write_register(output0, 0x00) == 0;  // col latches low
+}
@@ -0,0 +1,131 @@
+#ifndef IO_EXPANDER
+#define IO_EXPANDER
+
+#include <device.h>
+#include <zephyr.h>
+
+/**
+ * Drivers for the I/O expander of the left half. The columns are on the first port of the
+ * expander and are strobed by switching the pin between input (released) and output low, the rows
+ * are on the second port and read back inverted, so a pressed key reads as 1.
+ *
+ * All drivers provide the same operations, the board layout selects one with the BoardExpander
+ * typedef (see "expander" in the layout files), so the scan loop is compiled for the exact part:
+ *
+ *     bool init(device *i2c, uint16_t address);
+ *     int select_columns(uint8_t column_mask);
+ *     int read_rows(uint8_t *rows);
+ *     int scan_columns(const uint8_t *column_pins, uint8_t count, uint8_t *rows);
+ *     int calibrate_settle(uint8_t row_mask);
+ *     uint32_t settle_time_us() const;
+ *
+ * Every transfer is counted as ENERGY_EVENT_I2C_TRANSFER. Any error means the expander did not
+ * respond, init has to be called again before the next access.
+ */
+class I2cExpander {
+   protected:
+    device *i2c = nullptr;
+    uint16_t address = 0;
+    // last value written to the column direction register
+    uint8_t column_direction = 0xFF;
+    bool column_direction_valid = false;
+    // wait between selecting columns and reading the rows, 0 if the bus is slow enough
+    uint32_t settle_us = 0;
+
+    int write_register(uint8_t reg, uint8_t value);
+    int read_register(uint8_t reg, uint8_t *value);
+    int select_columns(uint8_t direction_reg, uint8_t column_mask);
+    int scan_columns(uint8_t direction_reg, uint8_t input_reg, const uint8_t *column_pins,
+                     uint8_t count, uint8_t *rows);
+    int calibrate_settle(uint8_t row_direction_reg, uint8_t row_output_reg, uint8_t input_reg,
+                         uint8_t row_mask);
+    uint32_t settle_time_us() const { return settle_us; }
+};
+
+/**
+ * Microchip MCP23017, columns on GPIOA and rows on GPIOB with the internal pull-ups.
+ */
+class Mcp23017 : private I2cExpander {
+   private:
+    // registers with IOCON.BANK = 0
+    static const uint8_t iodira = 0x00;
+    static const uint8_t iodirb = 0x01;
+    static const uint8_t ipolb = 0x03;
+    static const uint8_t gppua = 0x0C;
+    static const uint8_t gppub = 0x0D;
+    static const uint8_t gpioa = 0x12;
+    static const uint8_t gpiob = 0x13;
+
+   public:
+    /**
+     * Configures the ports and releases all columns, the first write doubles as presence check.
+     */
+    bool init(device *i2c, uint16_t address);
+
+    /**
+     * Drives the columns of the mask low and releases the others. Skipped if the columns are
+     * already selected, so an idle scan is a single read.
+     */
+    int select_columns(uint8_t column_mask) {
+        return I2cExpander::select_columns(iodira, column_mask);
+    }
+
+    /**
+     * Reads the rows of the selected columns, bit n is set if row pin n is low.
+     */
+    int read_rows(uint8_t *rows) { return read_register(gpiob, rows); }
+
+    /**
+     * Strobes the columns one after another and stores the rows of each column in rows[]. Each
+     * column is a single transaction: direction write and row read with repeated starts.
+     */
+    int scan_columns(const uint8_t *column_pins, uint8_t count, uint8_t *rows) {
+        return I2cExpander::scan_columns(iodira, gpiob, column_pins, count, rows);
+    }
+
+    /**
+     * Measures how long the rows take to be pulled up again after a column released them, with
+     * the columns released. Strobes are split into a direction write, a wait and a read if the
+     * rows are not settled by the time a combined transaction reads them.
+     */
+    int calibrate_settle(uint8_t row_mask) {
+        return I2cExpander::calibrate_settle(iodirb, gpiob, gpiob, row_mask);
+    }
+
+    using I2cExpander::settle_time_us;
+};
+
+/**
+ * NXP PCA9555 and TI TCA9555, columns on port 0 and rows on port 1. The PCA9555 has internal
+ * 100k pull-ups, the TCA9555 needs external pull-ups on the rows.
+ */
+class Pca9555 : private I2cExpander {
+   private:
+    static const uint8_t input1 = 0x01;
+    static const uint8_t output0 = 0x02;
+    static const uint8_t output1 = 0x03;
+    static const uint8_t polarity1 = 0x05;
+    static const uint8_t config0 = 0x06;
+    static const uint8_t config1 = 0x07;
+
+   public:
+    bool init(device *i2c, uint16_t address);
+
+    int select_columns(uint8_t column_mask) {
+        return I2cExpander::select_columns(config0, column_mask);
+    }
+
+    int read_rows(uint8_t *rows) { return read_register(input1, rows); }
+
+    int scan_columns(const uint8_t *column_pins, uint8_t count, uint8_t *rows) {
+        return I2cExpander::scan_columns(config0, input1, column_pins, count, rows);
+    }
+
+    int calibrate_settle(uint8_t row_mask) {
+        return I2cExpander::calibrate_settle(config1, output1, input1, row_mask);
+    }
+
+    using I2cExpander::settle_time_us;
+};
+
+#endif
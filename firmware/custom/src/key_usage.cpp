@@ -0,0 +1,127 @@
+#include "key_usage.h"
+
+#include <bluetooth/gatt.h>
+#include <logging/log.h>
+#include <settings/settings.h>
+
+#include <cstring>
+
+#include "board_layout.h"
+#include "vendor_uuids.h"
+
+LOG_MODULE_REGISTER(key_usage);
+
+namespace {
+const uint16_t matrix_positions = matrix_rows * matrix_columns;
+// how often the work queue checks whether a flush is due
+const uint32_t flush_check_interval_ms = 5 * 1000;
+
+// counters indexed by row * columns + column, written by the scan loop only
+uint32_t counts[matrix_positions] = {};
+// uptime of the last counted press, 0 while nothing changed since the last flush
+volatile uint32_t last_press_ms = 0;
+uint32_t last_flush_ms = 0;
+// copy of the counters being written, so the scan loop can keep counting meanwhile
+uint32_t flush_snapshot[matrix_positions];
+
+// GATT representation, the dimensions followed by the little endian counters in matrix order
+struct usage_record {
+    uint8_t rows;
+    uint8_t columns;
+    uint32_t counts[matrix_positions];
+} __packed;
+
+usage_record gatt_record;
+
+struct bt_uuid_128 usage_service_uuid = VENDOR_UUID_INIT(VENDOR_UUID_USAGE_SERVICE);
+struct bt_uuid_128 usage_counts_uuid = VENDOR_UUID_INIT(VENDOR_UUID_USAGE_COUNTS);
+
+int usage_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg) {
+    const char *next;
+
+    if (settings_name_steq(name, "counts", &next) && !next) {
+        // counters of a different matrix can not be mapped to positions
+        if (len != sizeof(counts)) {
+            LOG_WRN("Discarding stored key usage of unexpected size %d", len);
+            return 0;
+        }
+
+        const int err = read_cb(cb_arg, counts, sizeof(counts));
+        return err < 0 ? err : 0;
+    }
+
+    return -ENOENT;
+}
+
+struct settings_handler usage_conf = {.name = "usage", .h_set = usage_settings_set};
+
+void check_flush(struct k_work *work);
+K_DELAYED_WORK_DEFINE(flush_work, check_flush);
+
+/**
+ * Writes the counters if they changed, the keyboard is idle and the last write is long enough
+ * ago. Runs on the system work queue, so the flash write never blocks the scan loop.
+ */
+void check_flush(struct k_work *work) {
+    const uint32_t now = k_uptime_get_32();
+    const uint32_t last_press = last_press_ms;
+
+    if (last_press != 0 && now - last_press >= key_usage_idle_ms &&
+        (last_flush_ms == 0 || now - last_flush_ms >= key_usage_flush_interval_ms)) {
+        // cleared before the copy, so a press counted meanwhile is flushed again next time
+        last_press_ms = 0;
+        last_flush_ms = now;
+        memcpy(flush_snapshot, counts, sizeof(flush_snapshot));
+
+        if (settings_save_one("usage/counts", flush_snapshot, sizeof(flush_snapshot))) {
+            LOG_ERR("Saving key usage failed");
+        } else {
+            LOG_INF("Key usage saved");
+        }
+    }
+
+    k_delayed_work_submit(&flush_work, K_MSEC(flush_check_interval_ms));
+}
+
+ssize_t read_usage_counts(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf,
+                          uint16_t len, uint16_t offset) {
+    // take a fresh snapshot only at the start of a (long) read, so all parts are consistent
+    if (offset == 0) {
+        gatt_record.rows = matrix_rows;
+        gatt_record.columns = matrix_columns;
+        memcpy(gatt_record.counts, counts, sizeof(counts));
+    }
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &gatt_record, sizeof(gatt_record));
+}
+}  // namespace
+
+BT_GATT_SERVICE_DEFINE(usage_service, BT_GATT_PRIMARY_SERVICE(&usage_service_uuid),
+                       BT_GATT_CHARACTERISTIC(&usage_counts_uuid.uuid, BT_GATT_CHRC_READ,
+                                              BT_GATT_PERM_READ_ENCRYPT, read_usage_counts, nullptr,
+                                              nullptr));
+
+struct settings_handler *get_usage_conf() {
+    return &usage_conf;
+}
+
+void key_usage_init() { k_delayed_work_submit(&flush_work, K_MSEC(flush_check_interval_ms)); }
+
+void key_usage_record(std::pair<uint8_t, uint8_t> key) {
+    if (key.first >= matrix_rows || key.second >= matrix_columns) {
+        return;
+    }
+
+    counts[key.first * matrix_columns + key.second]++;
+    // 0 marks "nothing to flush", an uptime of exactly 0 ms is counted as 1 ms
+    const uint32_t now = k_uptime_get_32();
+    last_press_ms = now ? now : 1;
+}
+
+uint32_t key_usage_get(std::pair<uint8_t, uint8_t> key) {
+    if (key.first >= matrix_rows || key.second >= matrix_columns) {
+        return 0;
+    }
+
+    return counts[key.first * matrix_columns + key.second];
+}
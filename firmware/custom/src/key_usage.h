@@ -0,0 +1,35 @@
+#ifndef KEY_USAGE
+#define KEY_USAGE
+
+#include <zephyr.h>
+
+#include <utility>
+
+/**
+ * Lifetime press counters per matrix position. Counting is a single increment in RAM, the
+ * counters are written to the settings storage from the system work queue in one batch once the
+ * keyboard has been idle for a while, at most every key_usage_flush_interval_ms. They are readable
+ * through the vendor usage service.
+ */
+
+// minimum time between two writes to flash
+const uint32_t key_usage_flush_interval_ms = 30 * 60 * 1000;
+// time without key presses before changed counters are written
+const uint32_t key_usage_idle_ms = 10 * 1000;
+
+struct settings_handler *get_usage_conf();
+
+/**
+ * Starts the periodic flush check, call once after the settings were loaded.
+ */
+void key_usage_init();
+
+/**
+ * Counts a press of the key at the position. Only called from the scan loop, so the counters have
+ * a single writer and need no locking.
+ */
+void key_usage_record(std::pair<uint8_t, uint8_t> key);
+
+uint32_t key_usage_get(std::pair<uint8_t, uint8_t> key);
+
+#endif
@@ -0,0 +1,188 @@
+#include "keyboard_config.h"
+
+#include <bluetooth/gatt.h>
+#include <logging/log.h>
+#include <settings/settings.h>
+
+#include <algorithm>
+
+#include "battery_reader.h"
+#include "keycode_resolver.h"
+#include "macro_player.h"
+#include "vendor_uuids.h"
+
+LOG_MODULE_REGISTER(config);
+
+namespace {
+const keyboard_config default_config{.version = config_version,
+                                     .battery_curve = BATTERY_CURVE_SIGMOIDAL,
+                                     .polling_delay_ms = 1,
+                                     .polling_delay_disconnected_ms = 200,
+                                     .button_debounce_ms = 500,
+                                     .battery_reporting_interval_ms = 30000,
+                                     .battery_divider_ratio = 1.485f,
+                                     .battery_ref_voltage = 3700,
+                                     .battery_min_voltage = 3000,
+                                     .battery_max_voltage = 4200,
+                                     .reserved0 = 0,
+                                     .tapping_term_ms = 200,
+                                     .tap_hold_flags = TAP_HOLD_PERMISSIVE_HOLD,
+                                     .reserved1 = 0,
+                                     .combo_term_ms = 40,
+                                     .reserved2 = 0,
+                                     .macro_mode = MACRO_MODE_QUEUE,
+                                     .reserved3 = {},
+                                     .scan_active_dwell_ms = 250,
+                                     .scan_idle_dwell_ms = 2000,
+                                     .scan_rate_step = 4,
+                                     .reserved4 = {},
+                                     .stuck_key_timeout_ms = 60000};
+
+keyboard_config config = default_config;
+keyboard_config gatt_config;
+uint32_t generation = 0;
+struct k_spinlock config_lock;
+
+struct bt_uuid_128 config_service_uuid = VENDOR_UUID_INIT(VENDOR_UUID_CONFIG_SERVICE);
+struct bt_uuid_128 config_block_uuid = VENDOR_UUID_INIT(VENDOR_UUID_CONFIG_BLOCK);
+
+template <size_t size>
+bool cleared(const uint8_t (&reserved)[size]) {
+    return std::all_of(reserved, reserved + size, [](uint8_t byte) { return byte == 0; });
+}
+
+bool config_valid(const keyboard_config &candidate) {
+    return candidate.version == config_version && candidate.polling_delay_ms >= 1 &&
+           candidate.polling_delay_ms <= 100 &&
+           candidate.polling_delay_disconnected_ms >= candidate.polling_delay_ms &&
+           candidate.polling_delay_disconnected_ms <= 5000 &&
+           candidate.battery_reporting_interval_ms >= 1000 &&
+           candidate.battery_reporting_interval_ms <= 3600000 &&
+           candidate.button_debounce_ms <= 5000 && candidate.battery_ref_voltage >= 1000 &&
+           candidate.battery_ref_voltage <= 5000 &&
+           candidate.battery_min_voltage < candidate.battery_max_voltage &&
+           candidate.battery_divider_ratio > 0.5 && candidate.battery_divider_ratio < 10 &&
+           candidate.battery_curve < BATTERY_CURVE_COUNT && candidate.reserved0 == 0 &&
+           (candidate.tap_hold_flags & ~TAP_HOLD_FLAGS_ALL) == 0 &&
+           candidate.tapping_term_ms >= 50 && candidate.tapping_term_ms <= 1000 &&
+           candidate.reserved1 == 0 && candidate.combo_term_ms >= 5 &&
+           candidate.combo_term_ms <= 200 && candidate.reserved2 == 0 &&
+           candidate.macro_mode < MACRO_MODE_COUNT && cleared(candidate.reserved3) &&
+           candidate.scan_active_dwell_ms >= 10 && candidate.scan_idle_dwell_ms >= 10 &&
+           candidate.scan_rate_step >= 1 && candidate.scan_rate_step <= 16 &&
+           cleared(candidate.reserved4) &&
+           (candidate.stuck_key_timeout_ms == 0 || candidate.stuck_key_timeout_ms >= 5000);
+}
+
+void activate(const keyboard_config &candidate) {
+    k_spinlock_key_t key = k_spin_lock(&config_lock);
+    config = candidate;
+    generation++;
+    k_spin_unlock(&config_lock, key);
+}
+
+void save_config(struct k_work *work) {
+    const keyboard_config current = config_get();
+
+    if (settings_save_one("config/block", &current, sizeof(current))) {
+        LOG_ERR("Saving configuration failed");
+    } else {
+        LOG_INF("Configuration saved");
+    }
+}
+
+int config_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg) {
+    const char *next;
+
+    if (settings_name_steq(name, "block", &next) && !next) {
+        if (len > sizeof(keyboard_config)) {
+            LOG_WRN("Discarding stored configuration of unexpected size %d", len);
+            return 0;
+        }
+
+        // blocks stored before fields were appended keep the defaults for the new fields
+        keyboard_config stored = default_config;
+        int err = read_cb(cb_arg, &stored, len);
+        if (err < 0) {
+            return err;
+        }
+
+        if (config_valid(stored)) {
+            activate(stored);
+        } else {
+            LOG_WRN("Discarding invalid stored configuration");
+        }
+        return 0;
+    }
+
+    return -ENOENT;
+}
+
+struct settings_handler config_conf = {.name = "config", .h_set = config_settings_set};
+K_WORK_DEFINE(save_work, save_config);
+
+ssize_t read_config_block(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf,
+                          uint16_t len, uint16_t offset) {
+    if (offset == 0) {
+        gatt_config = config_get();
+    }
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &gatt_config, sizeof(gatt_config));
+}
+
+ssize_t write_config_block(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf,
+                           uint16_t len, uint16_t offset, uint8_t flags) {
+    if (offset != 0) {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    }
+
+    if (len != sizeof(keyboard_config)) {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+
+    keyboard_config candidate;
+    memcpy(&candidate, buf, sizeof(candidate));
+    if (config_set(candidate)) {
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+
+    return len;
+}
+}  // namespace
+
+BT_GATT_SERVICE_DEFINE(config_service, BT_GATT_PRIMARY_SERVICE(&config_service_uuid),
+                       BT_GATT_CHARACTERISTIC(&config_block_uuid.uuid,
+                                              BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+                                              BT_GATT_PERM_READ | BT_GATT_PERM_WRITE_ENCRYPT,
+                                              read_config_block, write_config_block, nullptr));
+
+struct settings_handler *get_config_conf() {
+    return &config_conf;
+}
+
+keyboard_config config_get() {
+    k_spinlock_key_t key = k_spin_lock(&config_lock);
+    const keyboard_config current = config;
+    k_spin_unlock(&config_lock, key);
+
+    return current;
+}
+
+int config_set(const keyboard_config &candidate) {
+    if (!config_valid(candidate)) {
+        LOG_ERR("Rejecting invalid configuration");
+        return -EINVAL;
+    }
+
+    activate(candidate);
+    k_work_submit(&save_work);
+    return 0;
+}
+
+uint32_t config_generation() {
+    k_spinlock_key_t key = k_spin_lock(&config_lock);
+    const uint32_t current = generation;
+    k_spin_unlock(&config_lock, key);
+
+    return current;
+}
@@ -0,0 +1,87 @@
+#ifndef KEYBOARD_CONFIG
+#define KEYBOARD_CONFIG
+
+#include <stddef.h>
+#include <zephyr.h>
+
+/**
+ * Runtime tunable scan and power parameters. The block is persisted as a whole under
+ * "config/block" and can be read and written through the vendor config GATT service. Fields are
+ * little endian and naturally aligned, the layout is shared with host tools and pinned by the
+ * static_asserts below. There is no implicit padding, spare bytes are reserved members that must be
+ * 0. New fields are only appended at the end, a layout that changes existing fields needs a new
+ * config_version.
+ */
+typedef struct keyboard_config {
+    uint8_t version;        // config_version
+    uint8_t battery_curve;  // battery_curve
+    uint16_t polling_delay_ms;
+    uint16_t polling_delay_disconnected_ms;
+    uint16_t button_debounce_ms;
+    uint32_t battery_reporting_interval_ms;
+    float battery_divider_ratio;
+    uint16_t battery_ref_voltage;   // millivolts
+    uint16_t battery_min_voltage;   // millivolts
+    uint16_t battery_max_voltage;   // millivolts
+    uint16_t reserved0;             // must be 0
+    uint16_t tapping_term_ms;       // dual-role keys held longer than this resolve to hold
+    uint8_t tap_hold_flags;         // tap_hold_flags
+    uint8_t reserved1;              // must be 0
+    uint16_t combo_term_ms;         // window in which all keys of a combo need to be pressed
+    uint16_t reserved2;             // must be 0
+    uint8_t macro_mode;             // macro_mode
+    uint8_t reserved3[3];           // must be 0
+    uint16_t scan_active_dwell_ms;  // full rate scanning continues this long after a key change
+    uint16_t scan_idle_dwell_ms;    // the idle rate continues this long before the slow rate
+    uint8_t scan_rate_step;         // each slower scan rate polls this many times slower
+    uint8_t reserved4[3];           // must be 0
+    uint32_t stuck_key_timeout_ms;  // keys held longer are masked until released, 0 disables
+} keyboard_config;
+
+const uint8_t config_version = 1;
+
+static_assert(offsetof(keyboard_config, battery_curve) == 1, "config layout");
+static_assert(offsetof(keyboard_config, polling_delay_ms) == 2, "config layout");
+static_assert(offsetof(keyboard_config, polling_delay_disconnected_ms) == 4, "config layout");
+static_assert(offsetof(keyboard_config, button_debounce_ms) == 6, "config layout");
+static_assert(offsetof(keyboard_config, battery_reporting_interval_ms) == 8, "config layout");
+static_assert(offsetof(keyboard_config, battery_divider_ratio) == 12, "config layout");
+static_assert(offsetof(keyboard_config, battery_ref_voltage) == 16, "config layout");
+static_assert(offsetof(keyboard_config, battery_min_voltage) == 18, "config layout");
+static_assert(offsetof(keyboard_config, battery_max_voltage) == 20, "config layout");
+static_assert(offsetof(keyboard_config, reserved0) == 22, "config layout");
+static_assert(offsetof(keyboard_config, tapping_term_ms) == 24, "config layout");
+static_assert(offsetof(keyboard_config, tap_hold_flags) == 26, "config layout");
+static_assert(offsetof(keyboard_config, reserved1) == 27, "config layout");
+static_assert(offsetof(keyboard_config, combo_term_ms) == 28, "config layout");
+static_assert(offsetof(keyboard_config, reserved2) == 30, "config layout");
+static_assert(offsetof(keyboard_config, macro_mode) == 32, "config layout");
+static_assert(offsetof(keyboard_config, reserved3) == 33, "config layout");
+static_assert(offsetof(keyboard_config, scan_active_dwell_ms) == 36, "config layout");
+static_assert(offsetof(keyboard_config, scan_idle_dwell_ms) == 38, "config layout");
+static_assert(offsetof(keyboard_config, scan_rate_step) == 40, "config layout");
+static_assert(offsetof(keyboard_config, reserved4) == 41, "config layout");
+static_assert(offsetof(keyboard_config, stuck_key_timeout_ms) == 44, "config layout");
+static_assert(sizeof(keyboard_config) == 48, "config layout");
+
+struct settings_handler *get_config_conf();
+
+/**
+ * Returns a copy of the active configuration. Safe to call from any thread.
+ */
+keyboard_config config_get();
+
+/**
+ * Validates and activates a new configuration and schedules it to be persisted.
+ *
+ * @return 0 on success, -EINVAL if any value is out of range
+ */
+int config_set(const keyboard_config &config);
+
+/**
+ * Returns a counter that is incremented on every configuration change, so consumers can cheaply
+ * detect when cached values need to be refreshed.
+ */
+uint32_t config_generation();
+
+#endif
@@ -2,85 +2,229 @@
 
 #include <drivers/gpio.h>
 #include <drivers/i2c.h>
+#include <logging/log.h>
+#include <zephyr.h>
 
-KeyboardMatrixScanner::KeyboardMatrixScanner(std::shared_ptr<device> gpio,
-                                             std::shared_ptr<device> i2c, uint8_t left_i2c_id,
-                                             keyboard_pins pins)
-    : gpio{gpio}, i2c{i2c}, left_i2c_id{left_i2c_id}, pins{pins} {
-    for (auto pin : pins.rows_right) {
-        gpio_pin_configure(gpio.get(), pin, GPIO_PULL_UP | GPIO_INPUT);
+#include <iterator>
+
+#include "board_layout.h"
+#include "energy_counters.h"
+#include "perf_counters.h"
+
+LOG_MODULE_REGISTER(matrix_scanner);
+
+namespace {
+constexpr uint8_t row_count = std::size(rows_right);
+constexpr uint8_t columns_left_count = std::size(columns_left);
+constexpr uint8_t columns_right_count = std::size(columns_right);
+
+static_assert(std::size(rows_left) == row_count, "both halves need the same rows");
+static_assert(row_count == matrix_rows, "row pins do not match the keymap");
+static_assert(columns_left_count + columns_right_count == matrix_columns,
+              "column pins do not match the keymap");
+
+const uint8_t settle_rounds = 8;
+// rows slower than this are treated as broken rather than waited for on every column
+const uint32_t max_settle_cycles = 50 * perf_cycles_per_us;
+
+inline void settle(uint32_t cycles) {
+    const uint32_t start = perf_cycles();
+    while (perf_cycles() - start < cycles) {
     }
+}
+}  // namespace
+
+void KeyboardMatrixScanner::init(device *gpio, device *i2c) {
+    this->gpio = gpio;
+    this->i2c = i2c;
 
-    for (auto pin : pins.columns_right) {
-        gpio_pin_configure(gpio.get(), pin, GPIO_DISCONNECTED);
+    for (auto pin : rows_right) {
+        gpio_pin_configure(gpio, pin, GPIO_PULL_UP | GPIO_INPUT);
     }
 
-    i2c_configure(i2c.get(), I2C_SPEED_SET(I2C_SPEED_FAST));
+    // unselected columns are driven high, the diodes keep them from affecting the rows
+    for (auto pin : columns_right) {
+        gpio_pin_configure(gpio, pin, GPIO_OUTPUT_HIGH);
+    }
+
+    i2c_configure(i2c, I2C_SPEED_SET(I2C_SPEED_FAST));
+    calibrate_right();
 }
 
-std::vector<std::pair<uint8_t, uint8_t>> KeyboardMatrixScanner::scan_matrix() {
-    std::vector<std::pair<uint8_t, uint8_t>> pressed_keys = scan_right();
-    std::vector<std::pair<uint8_t, uint8_t>> pressed_keys_left = scan_left();
-    pressed_keys.insert(std::end(pressed_keys), std::begin(pressed_keys_left),
-                        std::end(pressed_keys_left));
+void KeyboardMatrixScanner::calibrate_right() {
+    uint32_t slowest = 0;
+
+    // each row is discharged and released like by a column strobe, the columns stay high so held
+    // keys do not matter
+    for (auto pin : rows_right) {
+        for (uint8_t round = 0; round < settle_rounds; round++) {
+            gpio_pin_configure(gpio, pin, GPIO_OUTPUT_LOW);
+            gpio_pin_configure(gpio, pin, GPIO_PULL_UP | GPIO_INPUT);
+
+            const uint32_t start = perf_cycles();
+            gpio_port_value_t value = 0;
+            uint32_t elapsed = 0;
+            do {
+                gpio_port_get_raw(gpio, &value);
+                elapsed = perf_cycles() - start;
+            } while ((value & BIT(pin)) == 0 && elapsed <= max_settle_cycles);
+            slowest = MAX(slowest, elapsed);
+        }
+    }
 
-    return pressed_keys;
+    // twice the slowest rise as margin
+    settle_cycles_right = MIN(2 * slowest, max_settle_cycles);
+    LOG_INF("Right half columns settle in %u cycles", settle_cycles_right);
 }
 
-std::vector<std::pair<uint8_t, uint8_t>> KeyboardMatrixScanner::scan_right() {
-    std::vector<std::pair<uint8_t, uint8_t>> pressed_keys;
+matrix_scan KeyboardMatrixScanner::scan_matrix() {
+    EnergyScope energy_scope{ENERGY_SCANNING};
+    const uint32_t timestamp = k_uptime_get_32();
+    key_positions pressed_keys = scan_right();
+    for (auto key : scan_left()) {
+        pressed_keys.push_back(key);
+    }
 
-    for (uint8_t column = 0; column < pins.columns_right.size(); column++) {
-        gpio_pin_configure(gpio.get(), pins.columns_right[column], GPIO_OUTPUT_LOW);
+    return {timestamp, pressed_keys};
+}
 
-        for (uint8_t row = 0; row < pins.rows_right.size(); row++) {
-            if (gpio_pin_get(gpio.get(), pins.rows_right[row]) == 0) {
-                pressed_keys.push_back(std::make_pair(
-                    row, (pins.columns_right.size() - column - 1) + pins.columns_left.size()));
+key_positions KeyboardMatrixScanner::scan_right() {
+    PerfScope perf_scope{PERF_SCAN_RIGHT};
+    key_positions pressed_keys;
+    gpio_port_value_t value;
+    uint32_t sweep_mask = column_mask_right;
+
+    // fast path: drive all columns at once and only sweep if any row responds. Columns of stuck
+    // keys are left out and swept on their own.
+    if (!keys_held_right) {
+        const uint32_t probe_mask = column_mask_right & ~stuck_columns_right;
+        gpio_port_clear_bits_raw(gpio, probe_mask);
+        gpio_port_get_raw(gpio, &value);
+        gpio_port_set_bits_raw(gpio, probe_mask);
+
+        if ((~value & row_mask_right) == 0) {
+            if (!stuck_columns_right) {
+                return pressed_keys;
             }
+            sweep_mask = stuck_columns_right;
+        }
+    }
+
+    bool keys_held = false;
+#pragma GCC unroll 8
+    for (uint8_t column = 0; column < columns_right_count; column++) {
+        const uint32_t column_bit = BIT(columns_right[column]);
+        if ((sweep_mask & column_bit) == 0) {
+            continue;
+        }
+
+        gpio_port_clear_bits_raw(gpio, column_bit);
+        settle(settle_cycles_right);
+        gpio_port_get_raw(gpio, &value);
+        gpio_port_set_bits_raw(gpio, column_bit);
+
+        if ((~value & row_mask_right) == 0) {
+            continue;
         }
+        keys_held = keys_held || (stuck_columns_right & column_bit) == 0;
 
-        gpio_pin_configure(gpio.get(), pins.columns_right[column], GPIO_DISCONNECTED);
+#pragma GCC unroll 8
+        for (uint8_t row = 0; row < row_count; row++) {
+            if ((value & BIT(rows_right[row])) == 0) {
+                pressed_keys.push_back(
+                    std::make_pair(row, (columns_right_count - column - 1) + columns_left_count));
+            }
+        }
     }
 
+    keys_held_right = keys_held;
     return pressed_keys;
 }
 
-std::vector<std::pair<uint8_t, uint8_t>> KeyboardMatrixScanner::scan_left() {
-    std::vector<std::pair<uint8_t, uint8_t>> pressed_keys;
+key_positions KeyboardMatrixScanner::scan_left() {
+    PerfScope perf_scope{PERF_SCAN_LEFT};
+    key_positions pressed_keys;
 
-    auto err = i2c_reg_write_byte(i2c.get(), left_i2c_id, 0x05, 0x00);  // reset settings to default
+    if (!i2c_initialised) {
+        i2c_initialised =
+            expander.init(i2c, expander_i2c) && expander.calibrate_settle(row_mask_left) == 0;
+        keys_held_left = false;
+        if (i2c_initialised) {
+            LOG_INF("Left half columns settle in %u us", expander.settle_time_us());
+        }
 
-    if (err == 0) {  // left half is connected
-        if (!i2c_initialised) {
-            i2c_reg_write_byte(i2c.get(), left_i2c_id, 0x01, 0xFF);  // set port B (rows) to inputs
-            i2c_reg_write_byte(i2c.get(), left_i2c_id, 0x03, 0xFF);  // invert port B input polarity
-            i2c_reg_write_byte(i2c.get(), left_i2c_id, 0x0D, 0xFF);  // enable port B pull-ups
-            i2c_reg_write_byte(i2c.get(), left_i2c_id, 0x00, 0xFF);  // set port A (cols) to inputs
-            i2c_reg_write_byte(i2c.get(), left_i2c_id, 0x0C, 0x00);  // disable port A pull-ups
-            i2c_reg_write_byte(i2c.get(), left_i2c_id, 0x12, 0x00);  // set output latches of port A
-            i2c_initialised = true;
+        if (!i2c_initialised) {  // left half is not connected
+            return pressed_keys;
         }
+    }
 
-        for (uint8_t column = 0; column < pins.columns_left.size(); column++) {
-            uint8_t column_pin = pins.columns_left[column];
-            i2c_reg_write_byte(i2c.get(), left_i2c_id, 0x00,
-                               ~(1 << column_pin));  // set current column to output
+    // fast path: all columns stay driven between idle scans, so a single read of the rows tells
+    // whether a sweep is needed. Any failing transfer means the left half was disconnected.
+    // Columns of stuck keys are left out and swept on their own.
+    uint8_t sweep_mask = column_mask_left;
+    if (!keys_held_left) {
+        uint8_t value = 0;
+        if (expander.select_columns(column_mask_left & ~stuck_columns_left) ||
+            expander.read_rows(&value)) {
+            i2c_initialised = false;
+            return pressed_keys;
+        }
 
-            uint8_t value = 255;
-            i2c_reg_read_byte(i2c.get(), left_i2c_id, 0x13, &value);  // read port B (rows)
+        if ((value & row_mask_left) == 0) {
+            if (!stuck_columns_left) {
+                return pressed_keys;
+            }
+            sweep_mask = stuck_columns_left;
+        }
+    }
 
-            for (uint8_t row = 0; row < pins.rows_left.size(); row++) {
-                uint8_t row_pin = pins.rows_left[row];
+    uint8_t sweep_pins[columns_left_count];
+    uint8_t sweep_columns[columns_left_count];
+    uint8_t sweep_count = 0;
+    for (uint8_t column = 0; column < columns_left_count; column++) {
+        if (sweep_mask & BIT(columns_left[column])) {
+            sweep_pins[sweep_count] = columns_left[column];
+            sweep_columns[sweep_count++] = column;
+        }
+    }
 
-                if (((value & (1 << row_pin)) >> row_pin) == 1) {
-                    pressed_keys.push_back(std::make_pair(row, column));
-                }
+    uint8_t column_rows[columns_left_count];
+    if (expander.scan_columns(sweep_pins, sweep_count, column_rows)) {
+        i2c_initialised = false;
+        return pressed_keys;
+    }
+
+    bool keys_held = false;
+#pragma GCC unroll 8
+    for (uint8_t index = 0; index < sweep_count; index++) {
+        if ((column_rows[index] & row_mask_left) == 0) {
+            continue;
+        }
+        keys_held = keys_held || (stuck_columns_left & BIT(sweep_pins[index])) == 0;
+
+#pragma GCC unroll 8
+        for (uint8_t row = 0; row < row_count; row++) {
+            if (column_rows[index] & BIT(rows_left[row])) {
+                pressed_keys.push_back(std::make_pair(row, sweep_columns[index]));
             }
         }
-    } else {
-        i2c_initialised = false;
     }
 
+    keys_held_left = keys_held;
     return pressed_keys;
-}
\ No newline at end of file
+}
+
+void KeyboardMatrixScanner::set_stuck_keys(const key_positions &keys) {
+    stuck_columns_right = 0;
+    stuck_columns_left = 0;
+
+    for (auto key : keys) {
+        const uint8_t column = key.second;
+        if (column < columns_left_count) {
+            stuck_columns_left |= BIT(columns_left[column]);
+        } else {
+            stuck_columns_right |=
+                BIT(columns_right[columns_right_count - 1 - (column - columns_left_count)]);
+        }
+    }
+}
@@ -3,32 +3,62 @@
 
 #include <device.h>
 
-#include <memory>
 #include <utility>
-#include <vector>
 
-typedef struct keyboard_pins {
-    std::vector<uint8_t> rows_left;
-    std::vector<uint8_t> columns_left;
-    std::vector<uint8_t> rows_right;
-    std::vector<uint8_t> columns_right;
-} keyboard_pins;
+#include "board_layout.h"
+#include "static_vector.h"
+
+// further keys held at the same time are ignored
+const uint8_t max_pressed_keys = 16;
+
+typedef StaticVector<std::pair<uint8_t, uint8_t>, max_pressed_keys> key_positions;
+
+typedef struct matrix_scan {
+    uint32_t timestamp;  // uptime in milliseconds at the start of the scan
+    key_positions pressed_keys;
+} matrix_scan;
 
 class KeyboardMatrixScanner {
    private:
-    std::shared_ptr<device> gpio;
-    std::shared_ptr<device> i2c;
-    uint8_t left_i2c_id;
-    keyboard_pins pins;
+    device *gpio = nullptr;
+    device *i2c = nullptr;
     bool i2c_initialised = false;
+    BoardExpander expander;  // driver of the left half, selected by the board layout
+
+    // whether keys were held on the previous scan of a half, which forces a full sweep
+    bool keys_held_right = false;
+    bool keys_held_left = false;
 
-    std::vector<std::pair<uint8_t, uint8_t>> scan_left();
-    std::vector<std::pair<uint8_t, uint8_t>> scan_right();
+    // busy wait between driving a column of the right half and reading its rows, see init
+    uint32_t settle_cycles_right = 0;
+
+    // pin masks of the columns with stuck keys, only these are swept while idle
+    uint32_t stuck_columns_right = 0;
+    uint8_t stuck_columns_left = 0;
+
+    void calibrate_right();
+    key_positions scan_left();
+    key_positions scan_right();
 
    public:
-    KeyboardMatrixScanner(std::shared_ptr<device> gpio, std::shared_ptr<device> i2c,
-                          uint8_t left_i2c_id, keyboard_pins pins);
-    std::vector<std::pair<uint8_t, uint8_t>> scan_matrix();
+    /**
+     * Configures the matrix pins of the board, instances are statically allocated and initialised
+     * once at boot. Pins and port masks are compile time constants from board_layout.h, so the
+     * scan loops are unrolled for the exact matrix size.
+     *
+     * The time the rows take to be pulled up again after a column released them is measured for
+     * each row, and the scan waits the slowest of them before reading a column. The left half is
+     * measured through the expander whenever it is (re)connected.
+     */
+    void init(device *gpio, device *i2c);
+    matrix_scan scan_matrix();
+
+    /**
+     * Leaves the columns of stuck keys out of the idle check, so a stuck key does not force a
+     * full sweep of the matrix on every scan. Their columns are swept on their own instead, to
+     * notice the release. See stuck_keys.h.
+     */
+    void set_stuck_keys(const key_positions &keys);
 };
 
 #endif
\ No newline at end of file
@@ -3,59 +3,422 @@
 #include <zephyr.h>
 
 #include <algorithm>
-#include <stdexcept>
+#include <cstring>
 #include <logging/log.h>
+
+#include "event_trace.h"
+#include "perf_counters.h"
+
 LOG_MODULE_REGISTER(keys);
 
-KeycodeResolver::KeycodeResolver(dynamic_matrix<uint8_t> keycode_matrix,
-                                 dynamic_matrix<uint8_t> fn_matrix)
-    : keycode_matrix{keycode_matrix}, fn_matrix{fn_matrix} {
-    for (uint8_t rowIndex = 0; rowIndex < keycode_matrix.size(); rowIndex++) {
-        const auto row = keycode_matrix.at(rowIndex);
+namespace {
+// combos are pressed and released as virtual keys in this row, the column is the combo index
+const uint8_t combo_row = 0xFF;
+
+bool is_modifier(uint8_t keycode) { return keycode >= KEY_LEFTCTRL && keycode <= KEY_RIGHTMETA; }
+
+bool is_dual_role(keymap_action action) {
+    return ACTION_TYPE(action) == ACTION_TYPE_MOD_TAP ||
+           ACTION_TYPE(action) == ACTION_TYPE_LAYER_TAP;
+}
+
+void erase_one(key_list &values, uint8_t value) {
+    auto found = std::find(values.begin(), values.end(), value);
+    if (found != values.end()) {
+        values.erase(found);
+    }
+}
+}  // namespace
+
+void KeycodeResolver::set_keymap(const keymap_header *keymap) { this->keymap = keymap; }
 
-        for (uint8_t columnIndex = 0; columnIndex < row.size(); columnIndex++) {
-            if (row.at(columnIndex) == KEY_FN) {
-                fn_locations.push_back({rowIndex, columnIndex});
+void KeycodeResolver::set_tap_hold(uint8_t flags, uint16_t tapping_term_ms) {
+    tap_hold_flags = flags;
+    this->tapping_term_ms = tapping_term_ms;
+}
+
+void KeycodeResolver::set_combos(const combo *combos, uint8_t count) {
+    if (count > combo_max_count) {
+        LOG_ERR("Only %d combos are supported", combo_max_count);
+        count = combo_max_count;
+    }
+
+    this->combos = combos;
+    combo_count = count;
+    memset(position_combos, 0, sizeof(position_combos));
+
+    for (uint8_t index = 0; index < count; index++) {
+        for (uint8_t key = 0; key < combos[index].key_count && key < combo_max_keys; key++) {
+            const std::pair<uint8_t, uint8_t> position = combos[index].keys[key];
+            if (position.first < matrix_rows && position.second < matrix_columns) {
+                position_combos[position.first * matrix_columns + position.second] |= BIT(index);
             }
         }
     }
 }
 
-keycodes KeycodeResolver::resolve_keycodes(std::vector<std::pair<uint8_t, uint8_t>> pressed_keys) {
-    std::vector<uint8_t> keycodes;
-    std::vector<uint8_t> modifiers;
+void KeycodeResolver::set_combo_term(uint16_t combo_term_ms) {
+    this->combo_term_ms = combo_term_ms;
+}
 
-    auto fn_pressed = false;
-    for (auto fn_key : fn_locations) {
-        if (std::find(pressed_keys.begin(), pressed_keys.end(), fn_key) != pressed_keys.end()) {
-            fn_pressed = true;
-            break;
+uint32_t KeycodeResolver::key_combos(std::pair<uint8_t, uint8_t> key) {
+    return position_combos[key.first * matrix_columns + key.second];
+}
+
+int8_t KeycodeResolver::completed_combo() {
+    // every candidate contains all waiting keys, so a candidate with as many keys is complete
+    for (uint32_t candidates = combo_candidates; candidates != 0; candidates &= candidates - 1) {
+        const uint8_t index = __builtin_ctz(candidates);
+        if (combos[index].key_count == combo_events.size()) {
+            return index;
         }
     }
 
-    for (std::pair<uint8_t, uint8_t> key : pressed_keys) {
-        try {
-            uint8_t keycode;
-            if (fn_pressed == true) {
-                const auto fn_code = fn_matrix.at(key.first).at(key.second);
-                if (fn_code != KEY_NONE) {
-                    keycode = fn_code;
-                } else {
-                    keycode = keycode_matrix.at(key.first).at(key.second);
+    return -1;
+}
+
+/**
+ * Ends the current combo attempt: the completed combo is pressed or, if there is none, the
+ * waiting keys are passed on in the order they were pressed.
+ */
+void KeycodeResolver::flush_combo_events() {
+    const int8_t completed = active_combos.full() ? -1 : completed_combo();
+
+    if (completed >= 0) {
+        active_combos.push_back(
+            {static_cast<uint8_t>(completed),
+             static_cast<uint8_t>(BIT(combos[completed].key_count) - 1)});
+        queue_event({{combo_row, static_cast<uint8_t>(completed)}, true, combo_events.back().timestamp});
+    } else {
+        for (const key_event &event : combo_events) {
+            queue_event(event);
+        }
+    }
+
+    combo_events.clear();
+    combo_candidates = 0;
+}
+
+void KeycodeResolver::combo_press(const key_event &event) {
+    const uint32_t combos_of_key = key_combos(event.key);
+
+    if (!combo_events.empty() &&
+        (event.timestamp - combo_events.front().timestamp >= combo_term_ms ||
+         (combo_candidates & combos_of_key) == 0)) {
+        flush_combo_events();
+    }
+
+    // keys that are part of no combo are never held back
+    if (combo_events.empty() && combos_of_key == 0) {
+        queue_event(event);
+        return;
+    }
+
+    combo_candidates = combo_events.empty() ? combos_of_key : combo_candidates & combos_of_key;
+    combo_events.push_back(event);
+
+    // a completed combo only waits if a candidate with more keys could still complete
+    if (completed_combo() < 0) {
+        return;
+    }
+
+    for (uint32_t candidates = combo_candidates; candidates != 0; candidates &= candidates - 1) {
+        if (combos[__builtin_ctz(candidates)].key_count > combo_events.size()) {
+            return;
+        }
+    }
+
+    flush_combo_events();
+}
+
+void KeycodeResolver::combo_release(const key_event &event) {
+    // a key released while its combo is undecided acts on its own
+    if (std::any_of(combo_events.begin(), combo_events.end(),
+                    [&event](const key_event &waiting) { return waiting.key == event.key; })) {
+        flush_combo_events();
+    }
+
+    for (auto active = active_combos.begin(); active != active_combos.end(); active++) {
+        const combo &definition = combos[active->combo];
+        const uint8_t all_keys = BIT(definition.key_count) - 1;
+
+        for (uint8_t key = 0; key < definition.key_count; key++) {
+            if (definition.keys[key] != event.key || !(active->held_keys & BIT(key))) {
+                continue;
+            }
+
+            // the first released key releases the combo, the others are swallowed
+            if (active->held_keys == all_keys) {
+                queue_event({{combo_row, active->combo}, false, event.timestamp});
+            }
+
+            active->held_keys &= ~BIT(key);
+            if (active->held_keys == 0) {
+                active_combos.erase(active);
+            }
+            return;
+        }
+    }
+
+    queue_event(event);
+}
+
+void KeycodeResolver::queue_event(const key_event &event) {
+    const bool held =
+        std::any_of(held_keys.begin(), held_keys.end(),
+                    [&event](const held_key &candidate) { return candidate.key == event.key; });
+
+    // releasing a key pressed before the undecided key does not depend on the decision
+    if (!event.pressed && undecided && held) {
+        release(event.key);
+    } else if (!pending_events.push_back(event)) {
+        LOG_WRN("Too many pending key events, dropping one");
+    }
+}
+
+uint8_t KeycodeResolver::active_layer() {
+    // the highest held layer is active
+    for (int8_t layer = keymap->layers - 1; layer > 0; layer--) {
+        if (layer_holds[layer] > 0) {
+            return layer;
+        }
+    }
+
+    return 0;
+}
+
+keymap_action KeycodeResolver::resolve_action(uint8_t layer, std::pair<uint8_t, uint8_t> key) {
+    // upper layers fall through to the next lower layer where they are not defined
+    for (int8_t current = layer; current > 0; current--) {
+        const keymap_action action = keymap_get_action(keymap, current, key.first, key.second);
+        if (action != KC(KEY_NONE)) {
+            return action;
+        }
+    }
+
+    return keymap_get_action(keymap, 0, key.first, key.second);
+}
+
+/**
+ * Decides the undecided dual-role key at the front of pending_events from the events that
+ * followed it. Events are considered in order, so the decision is the same no matter how many
+ * scans later it is taken.
+ */
+KeycodeResolver::tap_hold_decision KeycodeResolver::decide(uint32_t now) {
+    const key_event &dual_role = pending_events.front();
+
+    for (size_t index = 1; index < pending_events.size(); index++) {
+        const key_event &event = pending_events[index];
+
+        if (event.timestamp - dual_role.timestamp >= tapping_term_ms) {
+            return TAP_HOLD_HOLD;
+        }
+
+        if (event.key == dual_role.key) {
+            return TAP_HOLD_TAP;
+        }
+
+        if (event.pressed && (tap_hold_flags & TAP_HOLD_HOLD_ON_OTHER_KEY_PRESS)) {
+            return TAP_HOLD_HOLD;
+        }
+
+        if (!event.pressed && (tap_hold_flags & TAP_HOLD_PERMISSIVE_HOLD)) {
+            // only keys pressed after the dual-role key count
+            for (size_t pressed = 1; pressed < index; pressed++) {
+                if (pending_events[pressed].key == event.key) {
+                    return TAP_HOLD_HOLD;
                 }
+            }
+        }
+    }
+
+    if (now - dual_role.timestamp >= tapping_term_ms) {
+        return TAP_HOLD_HOLD;
+    }
+
+    return TAP_HOLD_UNDECIDED;
+}
+
+void KeycodeResolver::process_events(uint32_t now) {
+    while (!pending_events.empty()) {
+        if (undecided) {
+            const tap_hold_decision decision = decide(now);
+            if (decision == TAP_HOLD_UNDECIDED) {
+                return;
+            }
+
+            undecided = false;
+            trace(TRACE_TAP_HOLD, decision == TAP_HOLD_HOLD, now - pending_events.front().timestamp);
+            press(pending_events.front(), undecided_action, decision == TAP_HOLD_HOLD);
+            pending_events.erase(pending_events.begin());
+            continue;
+        }
+
+        const key_event &event = pending_events.front();
+        if (event.pressed) {
+            const keymap_action action = event.key.first == combo_row
+                                             ? combos[event.key.second].action
+                                             : resolve_action(active_layer(), event.key);
+            if (is_dual_role(action)) {
+                // stays at the front until decided
+                undecided = true;
+                undecided_action = action;
+                continue;
+            }
+
+            press(event, action, false);
+        } else {
+            release(event.key);
+        }
+        pending_events.erase(pending_events.begin());
+    }
+}
+
+void KeycodeResolver::press(const key_event &event, keymap_action action, bool hold) {
+    held_keys.push_back({event.key, action, hold});
+
+    switch (ACTION_TYPE(action)) {
+        case ACTION_TYPE_KEY:
+            register_keycode(ACTION_ARGUMENT(action));
+            break;
+        case ACTION_TYPE_MOMENTARY_LAYER:
+            if (ACTION_ARGUMENT(action) < keymap_max_layers) {
+                layer_holds[ACTION_ARGUMENT(action)]++;
+            }
+            break;
+        case ACTION_TYPE_MACRO:
+            // reports registered so far go out before the macro starts
+            if (report_changed) {
+                add_report();
+            }
+            reports.push_back({{}, {}, static_cast<int16_t>(ACTION_ARGUMENT(action))});
+            break;
+        case ACTION_TYPE_MOD_TAP:
+            register_keycode(hold ? KEY_LEFTCTRL + ACTION_HOLD_ARGUMENT(action)
+                                  : ACTION_TAP_KEYCODE(action));
+            break;
+        case ACTION_TYPE_LAYER_TAP:
+            if (hold) {
+                layer_holds[ACTION_HOLD_ARGUMENT(action)]++;
             } else {
-                keycode = keycode_matrix.at(key.first).at(key.second);
+                register_keycode(ACTION_TAP_KEYCODE(action));
             }
+            break;
+    }
+}
 
-            if (keycode >= KEY_LEFTCTRL && keycode <= KEY_RIGHTMETA) {
-                modifiers.push_back(keycode);
-            } else if (keycode != KEY_FN) {
-                keycodes.push_back(keycode);
+void KeycodeResolver::release(std::pair<uint8_t, uint8_t> key) {
+    auto held = std::find_if(held_keys.begin(), held_keys.end(),
+                             [key](const held_key &candidate) { return candidate.key == key; });
+    if (held == held_keys.end()) {
+        return;
+    }
+
+    const keymap_action action = held->action;
+    const bool hold = held->hold;
+    held_keys.erase(held);
+
+    switch (ACTION_TYPE(action)) {
+        case ACTION_TYPE_KEY:
+            unregister_keycode(ACTION_ARGUMENT(action));
+            break;
+        case ACTION_TYPE_MOMENTARY_LAYER:
+            if (ACTION_ARGUMENT(action) < keymap_max_layers) {
+                layer_holds[ACTION_ARGUMENT(action)]--;
+            }
+            break;
+        case ACTION_TYPE_MACRO:
+            // macros play to the end on their own
+            break;
+        case ACTION_TYPE_MOD_TAP:
+            unregister_keycode(hold ? KEY_LEFTCTRL + ACTION_HOLD_ARGUMENT(action)
+                                    : ACTION_TAP_KEYCODE(action));
+            break;
+        case ACTION_TYPE_LAYER_TAP:
+            if (hold) {
+                layer_holds[ACTION_HOLD_ARGUMENT(action)]--;
+            } else {
+                unregister_keycode(ACTION_TAP_KEYCODE(action));
+            }
+            break;
+    }
+}
+
+void KeycodeResolver::register_keycode(uint8_t keycode) {
+    if (keycode == KEY_NONE) {
+        return;
+    }
+
+    if (is_modifier(keycode)) {
+        report.modifiers.push_back(keycode);
+    } else {
+        report.keycodes.push_back(keycode);
+    }
+    report_changed = true;
+    registered_since_report = true;
+}
+
+void KeycodeResolver::unregister_keycode(uint8_t keycode) {
+    if (keycode == KEY_NONE) {
+        return;
+    }
+
+    // the host has to see everything registered so far before anything is released, otherwise a
+    // tap within a single scan or a modifier released right after a key would be lost
+    if (registered_since_report) {
+        add_report();
+    }
+
+    erase_one(is_modifier(keycode) ? report.modifiers : report.keycodes, keycode);
+    report_changed = true;
+}
+
+void KeycodeResolver::add_report() {
+    // out of space the intermediate state is lost, but the latest one is always sent
+    if (!reports.push_back(report)) {
+        reports.back() = report;
+    }
+    report_changed = false;
+    registered_since_report = false;
+}
+
+const resolved_reports &KeycodeResolver::resolve_keycodes(const matrix_scan &scan) {
+    PerfScope perf_scope{PERF_RESOLVE_KEYCODES};
+    reports.clear();
+
+    if (scan.pressed_keys != previous_keys) {
+        // all edges of a scan share its timestamp, releases go first so a key released and
+        // another pressed within one scan are not taken as overlapping
+        for (auto key : previous_keys) {
+            if (std::find(scan.pressed_keys.begin(), scan.pressed_keys.end(), key) ==
+                scan.pressed_keys.end()) {
+                combo_release({key, false, scan.timestamp});
             }
-        } catch (const std::out_of_range&) {
-            LOG_ERR("Key position is not defined in matrix");
         }
+
+        for (auto key : scan.pressed_keys) {
+            if (key.first >= matrix_rows || key.second >= matrix_columns) {
+                LOG_ERR("Key position is not defined in matrix");
+                continue;
+            }
+
+            if (std::find(previous_keys.begin(), previous_keys.end(), key) ==
+                previous_keys.end()) {
+                combo_press({key, true, scan.timestamp});
+            }
+        }
+
+        previous_keys = scan.pressed_keys;
+    }
+
+    if (!combo_events.empty() && scan.timestamp - combo_events.front().timestamp >= combo_term_ms) {
+        flush_combo_events();
+    }
+
+    process_events(scan.timestamp);
+    if (report_changed) {
+        add_report();
     }
 
-    return {keycodes, modifiers};
-}
\ No newline at end of file
+    return reports;
+}
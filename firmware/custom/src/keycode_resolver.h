@@ -3,27 +3,130 @@
 
 #include <zephyr.h>
 
-#include <vector>
+#include <utility>
 
+#include "board_layout.h"
+#include "hid.h"
+#include "keyboard_matrix_scanner.h"
+#include "keymap.h"
+#include "static_vector.h"
 #include "usb_hid_keys.h"
 
 typedef struct keycodes {
-    std::vector<uint8_t> keycodes;
-    std::vector<uint8_t> modifiers;
+    key_list keycodes;
+    key_list modifiers;
+    int16_t macro = -1;  // if not negative, the entry starts this macro instead of being a report
 } keycodes;
 
-template <typename T>
-using dynamic_matrix = std::vector<std::vector<T>>;
+const uint8_t max_resolved_reports = 16;
+typedef StaticVector<keycodes, max_resolved_reports> resolved_reports;
 
+/**
+ * Rules that resolve a dual-role key to hold before it is released or the tapping term expires.
+ * Without any rule, keys pressed while a dual-role key is undecided are only applied once it is
+ * released (tap) or the tapping term expires (hold).
+ */
+enum tap_hold_flags : uint8_t {
+    // hold as soon as another key is pressed
+    TAP_HOLD_HOLD_ON_OTHER_KEY_PRESS = BIT(0),
+    // hold as soon as another key is pressed and released
+    TAP_HOLD_PERMISSIVE_HOLD = BIT(1),
+    TAP_HOLD_FLAGS_ALL = TAP_HOLD_HOLD_ON_OTHER_KEY_PRESS | TAP_HOLD_PERMISSIVE_HOLD,
+};
+
+/**
+ * Turns matrix scans into the sequence of keyboard reports to send. Key presses and releases are
+ * processed in the order they were scanned, the action of a key is looked up on the layer active
+ * when it was pressed and kept until it is released.
+ *
+ * Presses first pass the combo stage, which only holds back keys that are part of a combo, then
+ * the tap-hold stage, which only holds back keys pressed while a dual-role key is undecided.
+ */
 class KeycodeResolver {
    private:
-    dynamic_matrix<uint8_t> keycode_matrix;
-    dynamic_matrix<uint8_t> fn_matrix;
-    std::vector<std::pair<uint8_t, uint8_t>> fn_locations;
+    enum tap_hold_decision : uint8_t {
+        TAP_HOLD_UNDECIDED,
+        TAP_HOLD_TAP,
+        TAP_HOLD_HOLD,
+    };
+
+    typedef struct key_event {
+        std::pair<uint8_t, uint8_t> key;
+        bool pressed;
+        uint32_t timestamp;
+    } key_event;
+
+    typedef struct held_key {
+        std::pair<uint8_t, uint8_t> key;
+        keymap_action action;
+        bool hold;  // dual-role key resolved to hold
+    } held_key;
+
+    typedef struct active_combo {
+        uint8_t combo;
+        uint8_t held_keys;  // bitmask of combo keys not released yet
+    } active_combo;
+
+    const keymap_header *keymap = nullptr;
+    uint8_t tap_hold_flags = TAP_HOLD_PERMISSIVE_HOLD;
+    uint16_t tapping_term_ms = 200;
+
+    static const uint8_t max_pending_events = 32;
+    static const uint8_t max_active_combos = 8;
+    static const uint16_t matrix_positions = matrix_rows * matrix_columns;
+
+    key_positions previous_keys;
+    StaticVector<held_key, max_pressed_keys + max_active_combos> held_keys;
+    uint8_t layer_holds[keymap_max_layers] = {};
+
+    const combo *combos = nullptr;
+    uint8_t combo_count = 0;
+    uint16_t combo_term_ms = 40;
+    // bitmask of the combos each position (row * columns + column) takes part in
+    uint32_t position_combos[matrix_positions] = {};
+    // presses of combo keys wait here until a combo completes or can no longer complete
+    StaticVector<key_event, combo_max_keys> combo_events;
+    uint32_t combo_candidates = 0;
+    StaticVector<active_combo, max_active_combos> active_combos;
+
+    // while a dual-role key is undecided, its press and all following events wait here
+    StaticVector<key_event, max_pending_events> pending_events;
+    keymap_action undecided_action = KC(KEY_NONE);
+    bool undecided = false;
+
+    keycodes report;
+    bool report_changed = false;
+    bool registered_since_report = false;
+    resolved_reports reports;
+
+    uint32_t key_combos(std::pair<uint8_t, uint8_t> key);
+    int8_t completed_combo();
+    void flush_combo_events();
+    void combo_press(const key_event &event);
+    void combo_release(const key_event &event);
+    void queue_event(const key_event &event);
+    uint8_t active_layer();
+    keymap_action resolve_action(uint8_t layer, std::pair<uint8_t, uint8_t> key);
+    tap_hold_decision decide(uint32_t now);
+    void process_events(uint32_t now);
+    void press(const key_event &event, keymap_action action, bool hold);
+    void release(std::pair<uint8_t, uint8_t> key);
+    void register_keycode(uint8_t keycode);
+    void unregister_keycode(uint8_t keycode);
+    void add_report();
 
    public:
-    KeycodeResolver(dynamic_matrix<uint8_t> keycode_matrix, dynamic_matrix<uint8_t> fn_matrix);
-    keycodes resolve_keycodes(std::vector<std::pair<uint8_t, uint8_t>> pressed_keys);
+    void set_keymap(const keymap_header *keymap);
+    void set_tap_hold(uint8_t flags, uint16_t tapping_term_ms);
+    void set_combos(const combo *combos, uint8_t count);
+    void set_combo_term(uint16_t combo_term_ms);
+
+    /**
+     * Processes a scan and returns the reports to send in order, which is empty if nothing changed.
+     * Needs to be called on every scan, also when the pressed keys did not change, so that pending
+     * tap-hold decisions time out. The returned reports are valid until the next call.
+     */
+    const resolved_reports &resolve_keycodes(const matrix_scan &scan);
 };
 
-#endif
\ No newline at end of file
+#endif
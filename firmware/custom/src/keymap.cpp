@@ -0,0 +1,344 @@
+#include "keymap.h"
+
+#include <bluetooth/gatt.h>
+#include <logging/log.h>
+#include <storage/flash_map.h>
+#include <sys/byteorder.h>
+#include <sys/crc.h>
+
+#include "vendor_uuids.h"
+
+LOG_MODULE_REGISTER(keymap);
+
+namespace {
+const uint8_t slot_count = 2;
+const uint32_t slot_size = FLASH_AREA_SIZE(keymap) / slot_count;
+const int8_t default_slot = -1;
+// the value of an ATT write is at most the MTU minus the opcode and handle
+const uint16_t max_write_size = CONFIG_BT_L2CAP_RX_MTU - 3;
+const uint8_t upload_queue_length = 8;
+
+enum keymap_command : uint8_t {
+    KEYMAP_COMMAND_BEGIN = 0x01,  // followed by the keymap_header of the new image
+    KEYMAP_COMMAND_COMMIT = 0x02,
+    KEYMAP_COMMAND_ABORT = 0x03,
+};
+
+enum keymap_upload_state : uint8_t {
+    KEYMAP_UPLOAD_IDLE,
+    KEYMAP_UPLOAD_RECEIVING,
+};
+
+struct keymap_status {
+    uint8_t upload_state;
+    int8_t active_slot;
+    uint8_t queued_writes;  // not yet carried out, the state is final once this is 0
+    uint8_t reserved;
+    uint32_t active_sequence;
+    int32_t last_error;
+};
+
+const struct flash_area *keymap_area = nullptr;
+const keymap_header *default_keymap = nullptr;
+const keymap_header *active_keymap = nullptr;
+int8_t active_slot = default_slot;
+uint32_t generation = 0;
+uint32_t acquired_generation = 0;
+struct k_spinlock keymap_lock;
+
+// control and data writes, queued by the BT RX thread and carried out in order on the system work
+// queue, so erasing and writing the flash never stalls the Bluetooth stack
+typedef struct upload_write {
+    bool data;  // written to the data characteristic, else to the control characteristic
+    uint16_t len;
+    uint8_t value[max_write_size];
+} upload_write;
+
+K_MSGQ_DEFINE(upload_queue, sizeof(upload_write), upload_queue_length, 4);
+atomic_t upload_overflow = ATOMIC_INIT(0);
+
+// upload state, only accessed from the system work queue
+keymap_upload_state upload_state = KEYMAP_UPLOAD_IDLE;
+keymap_header pending_header;
+uint8_t pending_slot = 0;
+int32_t last_error = 0;
+keymap_status gatt_status;
+
+struct bt_uuid_128 keymap_service_uuid = VENDOR_UUID_INIT(VENDOR_UUID_KEYMAP_SERVICE);
+struct bt_uuid_128 keymap_control_uuid = VENDOR_UUID_INIT(VENDOR_UUID_KEYMAP_CONTROL);
+struct bt_uuid_128 keymap_data_uuid = VENDOR_UUID_INIT(VENDOR_UUID_KEYMAP_DATA);
+struct bt_uuid_128 keymap_status_uuid = VENDOR_UUID_INIT(VENDOR_UUID_KEYMAP_STATUS);
+
+const keymap_header *slot_header(uint8_t slot) {
+    return reinterpret_cast<const keymap_header *>(CONFIG_FLASH_BASE_ADDRESS +
+                                                   FLASH_AREA_OFFSET(keymap) + slot * slot_size);
+}
+
+uint32_t action_table_size(const keymap_header &header) {
+    return header.layers * header.rows * header.columns * sizeof(keymap_action);
+}
+
+uint32_t action_table_crc(const keymap_header *image) {
+    return crc32_ieee(reinterpret_cast<const uint8_t *>(image) + sizeof(keymap_header),
+                      action_table_size(*image));
+}
+
+bool header_valid(const keymap_header &header) {
+    return header.magic == keymap_magic && header.version == keymap_version &&
+           header.layers >= 1 && header.layers <= keymap_max_layers &&
+           header.rows == default_keymap->rows && header.columns == default_keymap->columns &&
+           header.length == sizeof(keymap_header) + action_table_size(header) &&
+           header.length <= slot_size;
+}
+
+bool slot_valid(uint8_t slot) {
+    const keymap_header *image = slot_header(slot);
+    return header_valid(*image) && action_table_crc(image) == image->crc;
+}
+
+void activate(int8_t slot) {
+    k_spinlock_key_t key = k_spin_lock(&keymap_lock);
+    active_slot = slot;
+    active_keymap = slot == default_slot ? default_keymap : slot_header(slot);
+    generation++;
+    k_spin_unlock(&keymap_lock, key);
+}
+
+int fail_upload(int error) {
+    upload_state = KEYMAP_UPLOAD_IDLE;
+    last_error = error;
+    return error;
+}
+
+int begin_upload(const uint8_t *data, uint16_t len) {
+    if (len != sizeof(keymap_header)) {
+        return fail_upload(-EINVAL);
+    }
+
+    memcpy(&pending_header, data, sizeof(pending_header));
+    if (!header_valid(pending_header)) {
+        LOG_ERR("Rejecting keymap upload with invalid header");
+        return fail_upload(-EINVAL);
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&keymap_lock);
+    const bool previous_acquired = acquired_generation == generation;
+    k_spin_unlock(&keymap_lock, key);
+
+    if (!previous_acquired) {
+        return fail_upload(-EBUSY);
+    }
+
+    pending_slot = active_slot == 0 ? 1 : 0;
+    if (flash_area_erase(keymap_area, pending_slot * slot_size, slot_size)) {
+        LOG_ERR("Erasing keymap slot %d failed", pending_slot);
+        return fail_upload(-EIO);
+    }
+
+    LOG_INF("Receiving keymap of %d layers into slot %d", pending_header.layers, pending_slot);
+    upload_state = KEYMAP_UPLOAD_RECEIVING;
+    last_error = 0;
+    return 0;
+}
+
+int commit_upload() {
+    if (upload_state != KEYMAP_UPLOAD_RECEIVING) {
+        return fail_upload(-EINVAL);
+    }
+
+    const keymap_header *image = slot_header(pending_slot);
+    if (crc32_ieee(reinterpret_cast<const uint8_t *>(image) + sizeof(keymap_header),
+                   action_table_size(pending_header)) != pending_header.crc) {
+        LOG_ERR("Keymap checksum mismatch");
+        return fail_upload(-EBADMSG);
+    }
+
+    // the header is written last, so the slot only becomes valid once the image is complete
+    pending_header.sequence = active_slot == default_slot ? 1 : active_keymap->sequence + 1;
+    if (flash_area_write(keymap_area, pending_slot * slot_size, &pending_header,
+                         sizeof(pending_header)) ||
+        !slot_valid(pending_slot)) {
+        LOG_ERR("Writing keymap header failed");
+        return fail_upload(-EIO);
+    }
+
+    activate(pending_slot);
+    upload_state = KEYMAP_UPLOAD_IDLE;
+    LOG_INF("Keymap %d in slot %d is now active", pending_header.sequence, pending_slot);
+    return 0;
+}
+
+void run_control(const uint8_t *data, uint16_t len) {
+    switch (data[0]) {
+        case KEYMAP_COMMAND_BEGIN:
+            begin_upload(data + 1, len - 1);
+            break;
+        case KEYMAP_COMMAND_COMMIT:
+            commit_upload();
+            break;
+        case KEYMAP_COMMAND_ABORT:
+            upload_state = KEYMAP_UPLOAD_IDLE;
+            break;
+    }
+}
+
+/**
+ * Data writes carry a little endian 32 bit offset into the action table followed by the data.
+ * Offsets and data lengths need to be multiples of 4, the last chunk is padded with 0xFF.
+ */
+void run_data(const uint8_t *data, uint16_t len) {
+    // left over from a failed or aborted upload
+    if (upload_state != KEYMAP_UPLOAD_RECEIVING) {
+        return;
+    }
+
+    const uint32_t table_offset = sys_get_le32(data);
+    const uint16_t data_len = len - sizeof(uint32_t);
+    const uint32_t padded_table_size = (action_table_size(pending_header) + 3) & ~3u;
+
+    if (table_offset % 4 != 0 || data_len % 4 != 0 || table_offset > padded_table_size ||
+        data_len > padded_table_size - table_offset) {
+        fail_upload(-EINVAL);
+        return;
+    }
+
+    if (flash_area_write(keymap_area,
+                         pending_slot * slot_size + sizeof(keymap_header) + table_offset,
+                         data + sizeof(uint32_t), data_len)) {
+        fail_upload(-EIO);
+    }
+}
+
+void check_overflow() {
+    if (atomic_clear(&upload_overflow)) {
+        LOG_ERR("Keymap writes arrived faster than the flash could take them");
+        fail_upload(-ENOBUFS);
+    }
+}
+
+void run_uploads(struct k_work *work) {
+    upload_write write;
+    while (k_msgq_get(&upload_queue, &write, K_NO_WAIT) == 0) {
+        check_overflow();
+        if (write.data) {
+            run_data(write.value, write.len);
+        } else {
+            run_control(write.value, write.len);
+        }
+    }
+
+    // the dropped write may have been the last one
+    check_overflow();
+}
+
+K_WORK_DEFINE(upload_work, run_uploads);
+
+ssize_t queue_write(bool data, const void *buf, uint16_t len) {
+    upload_write write = {data, len, {}};
+    memcpy(write.value, buf, len);
+
+    if (k_msgq_put(&upload_queue, &write, K_NO_WAIT)) {
+        // writes without response have no way to report this, the upload fails instead
+        atomic_set(&upload_overflow, 1);
+        k_work_submit(&upload_work);
+        return BT_GATT_ERR(BT_ATT_ERR_INSUFFICIENT_RESOURCES);
+    }
+
+    k_work_submit(&upload_work);
+    return len;
+}
+
+/**
+ * Control and data writes are only checked for their length here and acknowledged once queued.
+ * Their outcome is reported by the status characteristic: upload_state and last_error are final
+ * once queued_writes is 0.
+ */
+ssize_t write_keymap_control(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+                             const void *buf, uint16_t len, uint16_t offset, uint8_t flags) {
+    if (offset != 0 || len < 1 || len > max_write_size) {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+
+    const uint8_t command = static_cast<const uint8_t *>(buf)[0];
+    if (command != KEYMAP_COMMAND_BEGIN && command != KEYMAP_COMMAND_COMMIT &&
+        command != KEYMAP_COMMAND_ABORT) {
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+
+    return queue_write(false, buf, len);
+}
+
+ssize_t write_keymap_data(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf,
+                          uint16_t len, uint16_t offset, uint8_t flags) {
+    if (offset != 0 || len <= sizeof(uint32_t) || len > max_write_size) {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+
+    return queue_write(true, buf, len);
+}
+
+ssize_t read_keymap_status(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf,
+                           uint16_t len, uint16_t offset) {
+    gatt_status.upload_state = upload_state;
+    gatt_status.active_slot = active_slot;
+    gatt_status.queued_writes = k_msgq_num_used_get(&upload_queue);
+    gatt_status.active_sequence = active_keymap ? active_keymap->sequence : 0;
+    gatt_status.last_error = last_error;
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &gatt_status, sizeof(gatt_status));
+}
+}  // namespace
+
+BT_GATT_SERVICE_DEFINE(keymap_service, BT_GATT_PRIMARY_SERVICE(&keymap_service_uuid),
+                       BT_GATT_CHARACTERISTIC(&keymap_control_uuid.uuid, BT_GATT_CHRC_WRITE,
+                                              BT_GATT_PERM_WRITE_ENCRYPT, NULL,
+                                              write_keymap_control, nullptr),
+                       BT_GATT_CHARACTERISTIC(&keymap_data_uuid.uuid,
+                                              BT_GATT_CHRC_WRITE | BT_GATT_CHRC_WRITE_WITHOUT_RESP,
+                                              BT_GATT_PERM_WRITE_ENCRYPT, NULL, write_keymap_data,
+                                              nullptr),
+                       BT_GATT_CHARACTERISTIC(&keymap_status_uuid.uuid, BT_GATT_CHRC_READ,
+                                              BT_GATT_PERM_READ, read_keymap_status, NULL,
+                                              nullptr));
+
+void keymap_init(const keymap_header *default_map) {
+    default_keymap = default_map;
+
+    if (flash_area_open(FLASH_AREA_ID(keymap), &keymap_area)) {
+        LOG_ERR("Keymap partition not available, using default keymap");
+        activate(default_slot);
+        return;
+    }
+
+    int8_t newest_slot = default_slot;
+    for (uint8_t slot = 0; slot < slot_count; slot++) {
+        if (slot_valid(slot) && (newest_slot == default_slot ||
+                                 slot_header(slot)->sequence > slot_header(newest_slot)->sequence)) {
+            newest_slot = slot;
+        }
+    }
+
+    activate(newest_slot);
+    if (newest_slot == default_slot) {
+        LOG_INF("No stored keymap, using default keymap");
+    } else {
+        LOG_INF("Using stored keymap %d from slot %d", active_keymap->sequence, newest_slot);
+    }
+}
+
+const keymap_header *keymap_acquire() {
+    k_spinlock_key_t key = k_spin_lock(&keymap_lock);
+    const keymap_header *keymap = active_keymap;
+    acquired_generation = generation;
+    k_spin_unlock(&keymap_lock, key);
+
+    return keymap;
+}
+
+uint32_t keymap_generation() {
+    k_spinlock_key_t key = k_spin_lock(&keymap_lock);
+    const uint32_t current = generation;
+    k_spin_unlock(&keymap_lock, key);
+
+    return current;
+}
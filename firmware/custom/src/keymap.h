@@ -0,0 +1,115 @@
+#ifndef KEYMAP
+#define KEYMAP
+
+#include <zephyr.h>
+
+#include <utility>
+
+/**
+ * Binary keymap format. An image is a keymap_header directly followed by the action table
+ * actions[layers][rows][columns] of little endian 16 bit action codes. The same layout is used for
+ * the compiled-in default keymap and for keymaps stored in the "keymap" flash partition, so both
+ * are used in place without any parsing or copying.
+ *
+ * The upper 4 bits of an action code select the action type, the lower 12 bits are its argument.
+ * On layers above the base layer, KEY_NONE falls through to the next lower layer.
+ */
+typedef uint16_t keymap_action;
+
+enum keymap_action_type : uint8_t {
+    ACTION_TYPE_KEY = 0x0,               // argument is a USB HID keycode
+    ACTION_TYPE_MOMENTARY_LAYER = 0x1,   // argument is the layer active while held
+    ACTION_TYPE_MOD_TAP = 0x2,           // modifier index in bits 8-10, tap keycode in bits 0-7
+    ACTION_TYPE_LAYER_TAP = 0x3,         // layer in bits 8-11, tap keycode in bits 0-7
+    ACTION_TYPE_MACRO = 0x4,             // argument is the index of the macro played on press
+};
+
+#define ACTION_TYPE(action) static_cast<keymap_action_type>((action) >> 12)
+#define ACTION_ARGUMENT(action) ((action)&0x0FFF)
+
+#define KC(keycode) static_cast<keymap_action>(keycode)
+#define MO(layer) static_cast<keymap_action>((ACTION_TYPE_MOMENTARY_LAYER << 12) | (layer))
+#define MACRO(macro) static_cast<keymap_action>((ACTION_TYPE_MACRO << 12) | (macro))
+
+/**
+ * Dual-role keys: the keycode when tapped, the modifier (KEY_LEFTCTRL to KEY_RIGHTMETA) or layer
+ * when held. See KeycodeResolver for the tap-hold decision rules.
+ */
+#define MT(modifier, keycode)                                                                   \
+    static_cast<keymap_action>((ACTION_TYPE_MOD_TAP << 12) | (((modifier)-KEY_LEFTCTRL) << 8) | \
+                               (keycode))
+#define LT(layer, keycode) \
+    static_cast<keymap_action>((ACTION_TYPE_LAYER_TAP << 12) | ((layer) << 8) | (keycode))
+#define ACTION_TAP_KEYCODE(action) static_cast<uint8_t>((action)&0x00FF)
+#define ACTION_HOLD_ARGUMENT(action) static_cast<uint8_t>(((action) >> 8) & 0x0F)
+
+const uint32_t keymap_magic = 0x4D4B5741;  // "AWKM"
+const uint8_t keymap_version = 1;
+const uint8_t keymap_max_layers = 16;
+
+typedef struct keymap_header {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t layers;
+    uint8_t rows;
+    uint8_t columns;
+    uint32_t length;    // length of the whole image in bytes, header included
+    uint32_t sequence;  // incremented on every stored keymap, the highest valid one is active
+    uint32_t crc;       // CRC-32 (IEEE) of the action table
+} keymap_header;
+
+/**
+ * Compile time keymap image, used for the default keymap in board_mappings.h
+ */
+template <uint8_t layers, uint8_t rows, uint8_t columns>
+struct keymap_image {
+    keymap_header header;
+    keymap_action actions[layers][rows][columns];
+};
+
+#define KEYMAP_IMAGE_HEADER(layers, rows, columns)                                       \
+    {                                                                                    \
+        keymap_magic, keymap_version, layers, rows, columns,                             \
+            sizeof(keymap_image<layers, rows, columns>), 0, 0                            \
+    }
+
+/**
+ * Combos: all keys of a combo pressed within the combo term trigger its action instead of their
+ * own. A combo is released as soon as any of its keys is released.
+ */
+const uint8_t combo_max_keys = 4;
+const uint8_t combo_max_count = 32;
+
+typedef struct combo {
+    std::pair<uint8_t, uint8_t> keys[combo_max_keys];  // row and column
+    uint8_t key_count;
+    keymap_action action;
+} combo;
+
+static inline keymap_action keymap_get_action(const keymap_header *keymap, uint8_t layer,
+                                              uint8_t row, uint8_t column) {
+    const keymap_action *actions = reinterpret_cast<const keymap_action *>(
+        reinterpret_cast<const uint8_t *>(keymap) + sizeof(keymap_header));
+    return actions[(layer * keymap->rows + row) * keymap->columns + column];
+}
+
+/**
+ * Selects the keymap to use at boot: the valid stored keymap with the highest sequence number or,
+ * if there is none, the given compiled-in default. Stored keymaps must match the default in rows
+ * and columns.
+ */
+void keymap_init(const keymap_header *default_keymap);
+
+/**
+ * Returns the active keymap to the single consumer of the keymap. Uploads only ever erase the
+ * inactive slot and are refused until the consumer has acquired the latest keymap, so the returned
+ * image stays valid until the next call.
+ */
+const keymap_header *keymap_acquire();
+
+/**
+ * Returns a counter that is incremented whenever a new keymap becomes active.
+ */
+uint32_t keymap_generation();
+
+#endif
@@ -0,0 +1,78 @@
+#include "keystroke_buffer.h"
+
+#include <logging/log.h>
+
+#include <algorithm>
+
+#include "event_trace.h"
+#include "macro_player.h"
+#include "static_vector.h"
+
+LOG_MODULE_REGISTER(keystroke_buffer);
+
+namespace {
+typedef struct buffered_entry {
+    keycodes entry;
+    uint32_t timestamp;
+} buffered_entry;
+
+StaticVector<buffered_entry, keystroke_buffer_capacity> buffer;
+uint16_t dropped = 0;  // for lack of space
+
+// number of entries at the front older than the maximum age
+uint8_t stale_entries(uint32_t now) {
+    uint8_t stale = 0;
+    while (stale < buffer.size() && now - buffer[stale].timestamp > keystroke_buffer_max_age_ms) {
+        stale++;
+    }
+    return stale;
+}
+}  // namespace
+
+void keystroke_buffer_push(const keycodes &entry, uint32_t timestamp) {
+    // make room from stale entries first, they are dropped on flush anyway
+    const uint8_t stale = stale_entries(timestamp);
+    if (stale > 0) {
+        buffer.erase(buffer.begin(), buffer.begin() + stale);
+    }
+
+    if (buffer.push_back({entry, timestamp})) {
+        return;
+    }
+
+    dropped++;
+    if (entry.macro >= 0) {
+        return;
+    }
+
+    if (buffer.back().entry.macro < 0) {
+        buffer.back() = {entry, timestamp};
+        return;
+    }
+
+    // the latest state is never dropped, it may release keys
+    auto oldest_macro =
+        std::find_if(buffer.begin(), buffer.end(),
+                     [](const buffered_entry &queued) { return queued.entry.macro >= 0; });
+    buffer.erase(oldest_macro);
+    buffer.push_back({entry, timestamp});
+}
+
+void keystroke_buffer_flush(bt_conn *conn, uint32_t now) {
+    if (buffer.empty()) {
+        return;
+    }
+
+    const uint8_t stale = stale_entries(now);
+    for (uint8_t index = stale; index < buffer.size(); index++) {
+        macro_report(conn, buffer[index].entry);
+    }
+
+    LOG_INF("Sent %d buffered entries, dropped %d stale and %d for lack of space",
+            buffer.size() - stale, stale, dropped);
+    trace(TRACE_BUFFER_FLUSH, buffer.size() - stale, stale);
+    buffer.clear();
+    dropped = 0;
+}
+
+bool keystroke_buffer_empty() { return buffer.empty(); }
@@ -0,0 +1,35 @@
+#ifndef KEYSTROKE_BUFFER
+#define KEYSTROKE_BUFFER
+
+#include <bluetooth/conn.h>
+#include <zephyr.h>
+
+#include "keycode_resolver.h"
+
+/**
+ * Holds the resolved entries of keys typed while no connection is ready to send, e.g. while the
+ * link comes back after a disconnect or the keystroke that woke the keyboard. Entries are handed
+ * to the macro player in order once the connection is encrypted and input reports are
+ * subscribed, entries older than keystroke_buffer_max_age_ms are dropped instead.
+ *
+ * Only used by the scan loop, so no locking is needed.
+ */
+
+const uint8_t keystroke_buffer_capacity = 32;
+// older entries are dropped, they would surprise the user more than they help
+const uint32_t keystroke_buffer_max_age_ms = 5 * 1000;
+
+/**
+ * Buffers an entry resolved from a scan at the timestamp. When full, intermediate states or the
+ * oldest buffered macro are lost but the latest state is kept, so no release gets lost.
+ */
+void keystroke_buffer_push(const keycodes &entry, uint32_t timestamp);
+
+/**
+ * Drops stale entries and hands the remaining ones to the macro player in order.
+ */
+void keystroke_buffer_flush(bt_conn *conn, uint32_t now);
+
+bool keystroke_buffer_empty();
+
+#endif
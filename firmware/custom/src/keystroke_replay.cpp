@@ -0,0 +1,222 @@
+#include "keystroke_replay.h"
+
+#include <logging/log.h>
+#include <shell/shell.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include "board_layout.h"
+#include "perf_counters.h"
+#include "static_vector.h"
+
+LOG_MODULE_REGISTER(keystroke_replay);
+
+namespace {
+// events per run, longer recordings are replayed in parts by the host
+const uint16_t replay_capacity = 256;
+const uint32_t max_speed_percent = 100000;
+
+typedef struct replay_stats {
+    uint32_t events;
+    uint32_t loops;
+    uint64_t cycles;
+    uint32_t peak_queued_reports;
+    uint32_t lag_ms;
+    uint32_t elapsed_ms;
+} replay_stats;
+
+StaticVector<replay_event, replay_capacity> events;
+// set by the shell, cleared by the main loop once the replay is done
+volatile bool running = false;
+// set by the shell, the main loop skips the remaining events with its next scan
+atomic_t stop_requested = ATOMIC_INIT(0);
+uint32_t speed_percent = 100;
+
+// main loop state of the running replay
+size_t next_event = 0;
+uint32_t clock_start_ms = 0;  // uptime at replay time 0, moved when the replay lags
+uint32_t run_start_ms = 0;
+uint32_t timestamp_base = 0;  // scan timestamp at replay time 0
+key_positions held_keys;
+
+replay_stats stats;
+struct k_spinlock stats_lock;
+
+void apply_event(const replay_event &event) {
+    const auto key = std::make_pair(event.row, event.column);
+    auto position = std::find(held_keys.begin(), held_keys.end(), key);
+
+    if (event.pressed && position == held_keys.end()) {
+        held_keys.push_back(key);
+    } else if (!event.pressed && position != held_keys.end()) {
+        held_keys.erase(position);
+    }
+}
+
+uint32_t parse_number(const char *text, bool *valid) {
+    char *end = nullptr;
+    const unsigned long value = strtoul(text, &end, 10);
+    *valid = *valid && end != text && *end == '\0';
+    return value;
+}
+
+int cmd_replay_add(const struct shell *shell, size_t argc, char **argv) {
+    if (running) {
+        shell_error(shell, "replay is running");
+        return -EBUSY;
+    }
+
+    bool valid = true;
+    const replay_event event = {parse_number(argv[1], &valid),
+                                static_cast<uint8_t>(parse_number(argv[2], &valid)),
+                                static_cast<uint8_t>(parse_number(argv[3], &valid)),
+                                parse_number(argv[4], &valid) != 0};
+    if (!valid || event.row >= matrix_rows || event.column >= matrix_columns ||
+        (!events.empty() && event.at_ms < events.back().at_ms)) {
+        shell_error(shell, "invalid event");
+        return -EINVAL;
+    }
+
+    if (!events.push_back(event)) {
+        shell_error(shell, "no room for more than %u events", replay_capacity);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+int cmd_replay_clear(const struct shell *shell, size_t argc, char **argv) {
+    if (running) {
+        shell_error(shell, "replay is running");
+        return -EBUSY;
+    }
+
+    events.clear();
+    shell_print(shell, "replay cleared");
+    return 0;
+}
+
+int cmd_replay_run(const struct shell *shell, size_t argc, char **argv) {
+    if (running) {
+        shell_error(shell, "replay is running");
+        return -EBUSY;
+    }
+
+    bool valid = true;
+    const uint32_t speed = argc > 1 ? parse_number(argv[1], &valid) : 100;
+    if (!valid || speed == 0 || speed > max_speed_percent) {
+        shell_error(shell, "speed needs to be 1 - %u %%", max_speed_percent);
+        return -EINVAL;
+    }
+
+    speed_percent = speed;
+    next_event = 0;
+    held_keys.clear();
+    run_start_ms = k_uptime_get_32();
+    clock_start_ms = run_start_ms;
+    timestamp_base = run_start_ms;
+
+    k_spinlock_key_t key = k_spin_lock(&stats_lock);
+    stats = {};
+    k_spin_unlock(&stats_lock, key);
+
+    shell_print(shell, "replaying %u events at %u %%", events.size(), speed_percent);
+    atomic_clear(&stop_requested);
+    running = true;
+    return 0;
+}
+
+int cmd_replay_stop(const struct shell *shell, size_t argc, char **argv) {
+    // the main loop releases the keys still held with its next scan
+    atomic_set(&stop_requested, 1);
+    return 0;
+}
+
+int cmd_replay_stats(const struct shell *shell, size_t argc, char **argv) {
+    k_spinlock_key_t key = k_spin_lock(&stats_lock);
+    const replay_stats snapshot = stats;
+    k_spin_unlock(&stats_lock, key);
+
+    const uint32_t cycles_per_event =
+        snapshot.events ? static_cast<uint32_t>(snapshot.cycles / snapshot.events) : 0;
+    shell_print(shell, "replay %s events=%u/%u loops=%u cycles_per_event=%u peak_queue=%u "
+                "lag_ms=%u elapsed_ms=%u",
+                running ? "running" : "done", snapshot.events, events.size(), snapshot.loops,
+                cycles_per_event, snapshot.peak_queued_reports, snapshot.lag_ms,
+                snapshot.elapsed_ms);
+    shell_print(shell, "(%u cycles per microsecond)", perf_cycles_per_us);
+    return 0;
+}
+}  // namespace
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+    replay_commands,
+    SHELL_CMD_ARG(add, NULL, "Add an event: <ms> <row> <column> <pressed 1|0>", cmd_replay_add,
+                  5, 0),
+    SHELL_CMD(clear, NULL, "Remove all events", cmd_replay_clear),
+    SHELL_CMD_ARG(run, NULL, "Replay the events at [speed %, default 100]", cmd_replay_run, 1, 1),
+    SHELL_CMD(stop, NULL, "Stop the running replay", cmd_replay_stop),
+    SHELL_CMD(stats, NULL, "Show the results of the last replay", cmd_replay_stats),
+    SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(replay, &replay_commands, "Replay recorded key timelines", NULL);
+
+bool keystroke_replay_active() { return running; }
+
+matrix_scan keystroke_replay_scan() {
+    if (atomic_clear(&stop_requested)) {
+        next_event = events.size();
+    }
+
+    const uint32_t now = k_uptime_get_32();
+    uint32_t replay_ms = static_cast<uint64_t>(now - clock_start_ms) * speed_percent / 100;
+    uint32_t lag_ms = 0;
+    uint32_t applied = 0;
+
+    if (next_event < events.size() && events[next_event].at_ms <= replay_ms) {
+        const uint32_t at_ms = events[next_event].at_ms;
+        if (replay_ms > at_ms) {
+            // hold the clock at the event, so the events of the next times get scans of their own
+            lag_ms = replay_ms - at_ms;
+            clock_start_ms = now - static_cast<uint64_t>(at_ms) * 100 / speed_percent;
+            replay_ms = at_ms;
+        }
+
+        while (next_event < events.size() && events[next_event].at_ms == at_ms) {
+            apply_event(events[next_event++]);
+            applied++;
+        }
+    } else if (next_event >= events.size()) {
+        // recordings may end with keys held, or the replay was stopped
+        held_keys.clear();
+    }
+
+    const bool done = next_event >= events.size() && held_keys.empty();
+    k_spinlock_key_t key = k_spin_lock(&stats_lock);
+    stats.events += applied;
+    stats.lag_ms += lag_ms;
+    if (done) {
+        stats.elapsed_ms = now - run_start_ms;
+    }
+    k_spin_unlock(&stats_lock, key);
+
+    if (done) {
+        LOG_INF("Replay done after %u ms", now - run_start_ms);
+        running = false;
+    }
+
+    return {timestamp_base + replay_ms, held_keys};
+}
+
+uint16_t keystroke_replay_scan_delay_ms(uint16_t polling_delay_ms) {
+    // the main loop has to sleep, or the shell and log threads starve during fast replays
+    return MAX(static_cast<uint32_t>(polling_delay_ms) * 100 / speed_percent, 1);
+}
+
+void keystroke_replay_account(uint32_t loop_cycles, size_t queued_reports) {
+    k_spinlock_key_t key = k_spin_lock(&stats_lock);
+    stats.loops++;
+    stats.cycles += loop_cycles;
+    stats.peak_queued_reports = MAX(stats.peak_queued_reports, queued_reports);
+    k_spin_unlock(&stats_lock, key);
+}
@@ -0,0 +1,46 @@
+#ifndef KEYSTROKE_REPLAY
+#define KEYSTROKE_REPLAY
+
+#include <zephyr.h>
+
+#include "keyboard_matrix_scanner.h"
+
+/**
+ * Replays recorded key timelines in place of the matrix, through the resolver, macro player and
+ * report path of the main loop. Loaded and started with the 'replay' shell command, normally by
+ * tools/keystroke_replay.py together with the UART transport.
+ *
+ * The replay runs at a speed relative to the recording; the scan rate is scaled with it and scan
+ * timestamps follow the replay time, so tap-hold and combo terms see the recorded timing. A scan
+ * never applies events of two different times: if the main loop falls behind, the replay clock
+ * waits for it and the delay is reported as lag.
+ */
+typedef struct replay_event {
+    uint32_t at_ms;  // since the start of the recording, not decreasing
+    uint8_t row;
+    uint8_t column;
+    bool pressed;
+} replay_event;
+
+bool keystroke_replay_active();
+
+/**
+ * Returns the simulated matrix for the current replay time. Stops the replay once all events are
+ * applied and all keys are released again.
+ */
+matrix_scan keystroke_replay_scan();
+
+/**
+ * Returns the delay between scans while replaying for the configured polling delay. It is at
+ * least 1 ms, faster replays are held back by the scan rate and report the difference as lag.
+ */
+uint16_t keystroke_replay_scan_delay_ms(uint16_t polling_delay_ms);
+
+/**
+ * Accounts a main loop iteration that used a replayed scan, with the reports queued for BLE after
+ * it. The peak queue depth is only meaningful for replays over BLE, the UART transport has no
+ * queue.
+ */
+void keystroke_replay_account(uint32_t loop_cycles, size_t queued_reports);
+
+#endif
@@ -0,0 +1,267 @@
+#include "macro_player.h"
+
+#include <logging/log.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "event_trace.h"
+#include "hid.h"
+#include "usb_hid_keys.h"
+
+LOG_MODULE_REGISTER(macros);
+
+namespace {
+const uint8_t deferred_capacity = 32;
+
+const macro_step *const *macros = nullptr;
+uint8_t macro_count = 0;
+uint8_t mode = MACRO_MODE_QUEUE;
+
+// playing macro, step is nullptr while idle
+uint16_t playing_macro = 0;
+const macro_step *step = nullptr;
+keycodes macro_keys;
+bool delaying = false;
+uint32_t delay_start = 0;
+uint16_t text_index = 0;
+uint8_t text_keycode = KEY_NONE;  // last typed character while it is still pressed
+bool text_shift = false;
+
+// reports and macros waiting for the playing macro or for space in the report queue
+StaticVector<keycodes, deferred_capacity> deferred;
+keycodes live_report;
+
+bool is_modifier(uint8_t keycode) { return keycode >= KEY_LEFTCTRL && keycode <= KEY_RIGHTMETA; }
+
+bool ascii_keycode(char character, uint8_t &keycode, bool &shift) {
+    static const char unshifted[] = " -=[]\\;'`,./\n\t";
+    static const uint8_t unshifted_keycodes[] = {
+        KEY_SPACE,     KEY_MINUS,     KEY_EQUAL,      KEY_LEFTBRACE, KEY_RIGHTBRACE,
+        KEY_BACKSLASH, KEY_SEMICOLON, KEY_APOSTROPHE, KEY_GRAVE,     KEY_COMMA,
+        KEY_DOT,       KEY_SLASH,     KEY_ENTER,      KEY_TAB};
+    static const char shifted[] = "_+{}|:\"~<>?";
+    static const uint8_t shifted_keycodes[] = {
+        KEY_MINUS,      KEY_EQUAL, KEY_LEFTBRACE, KEY_RIGHTBRACE, KEY_BACKSLASH, KEY_SEMICOLON,
+        KEY_APOSTROPHE, KEY_GRAVE, KEY_COMMA,     KEY_DOT,        KEY_SLASH};
+    static const char shifted_digits[] = ")!@#$%^&*(";
+
+    auto digit_keycode = [](uint8_t digit) -> uint8_t {
+        return digit == 0 ? KEY_0 : KEY_1 + digit - 1;
+    };
+
+    if (character == '\0') {
+        return false;
+    }
+
+    shift = false;
+    if (character >= 'a' && character <= 'z') {
+        keycode = KEY_A + character - 'a';
+    } else if (character >= 'A' && character <= 'Z') {
+        keycode = KEY_A + character - 'A';
+        shift = true;
+    } else if (character >= '0' && character <= '9') {
+        keycode = digit_keycode(character - '0');
+    } else if (const char *found = strchr(shifted_digits, character)) {
+        keycode = digit_keycode(found - shifted_digits);
+        shift = true;
+    } else if (const char *found = strchr(unshifted, character)) {
+        keycode = unshifted_keycodes[found - unshifted];
+    } else if (const char *found = strchr(shifted, character)) {
+        keycode = shifted_keycodes[found - shifted];
+        shift = true;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+void send(bt_conn *conn, const keycodes &report) {
+    if (report.keycodes.empty() && report.modifiers.empty()) {
+        notify_keyrelease(conn);
+    } else {
+        notify_keycodes(conn, report.keycodes, report.modifiers);
+    }
+}
+
+keycodes with_key(uint8_t keycode, bool shift) {
+    keycodes report = macro_keys;
+    report.keycodes.push_back(keycode);
+    if (shift) {
+        report.modifiers.push_back(KEY_LEFTSHIFT);
+    }
+
+    return report;
+}
+
+void start_macro(uint16_t macro) {
+    if (macro >= macro_count) {
+        LOG_WRN("Macro %d is not defined", macro);
+        return;
+    }
+
+    trace(TRACE_MACRO_START, macro);
+    playing_macro = macro;
+    step = macros[macro];
+    macro_keys = {};
+    delaying = false;
+    text_index = 0;
+    text_keycode = KEY_NONE;
+}
+
+void stop_macro(bool interrupted) {
+    trace(TRACE_MACRO_END, playing_macro, interrupted);
+    step = nullptr;
+    macro_keys = {};
+}
+
+void defer(const keycodes &entry) {
+    if (deferred.push_back(entry)) {
+        return;
+    }
+
+    if (entry.macro >= 0) {
+        LOG_WRN("Too many deferred reports, dropping macro %d", entry.macro);
+        return;
+    }
+
+    if (deferred.back().macro < 0) {
+        // out of space, the intermediate state is lost but the latest one is kept
+        deferred.back() = entry;
+        return;
+    }
+
+    // reports are never dropped, a lost release would leave keys pressed on the host
+    auto oldest_macro = std::find_if(deferred.begin(), deferred.end(),
+                                     [](const keycodes &queued) { return queued.macro >= 0; });
+    LOG_WRN("Too many deferred reports, dropping macro %d", oldest_macro->macro);
+    deferred.erase(oldest_macro);
+    deferred.push_back(entry);
+}
+
+void send_deferred(bt_conn *conn) {
+    while (!step && !deferred.empty() && hid_report_queue_space() > 0) {
+        const keycodes entry = deferred.front();
+        deferred.erase(deferred.begin());
+
+        if (entry.macro >= 0) {
+            start_macro(entry.macro);
+        } else {
+            send(conn, entry);
+        }
+    }
+}
+
+void type_character(bt_conn *conn) {
+    const char character = step->text[text_index];
+    if (character == '\0') {
+        if (text_keycode != KEY_NONE) {
+            send(conn, macro_keys);
+        }
+        text_keycode = KEY_NONE;
+        text_index = 0;
+        step++;
+        return;
+    }
+
+    text_index++;
+    uint8_t keycode;
+    bool shift;
+    if (!ascii_keycode(character, keycode, shift)) {
+        return;
+    }
+
+    // the host only sees separate key strokes if the previous one is released in between, which
+    // is needed for repeated keys and for shift changes that might be applied out of order
+    if (text_keycode != KEY_NONE && (keycode == text_keycode || shift != text_shift)) {
+        send(conn, macro_keys);
+    }
+
+    send(conn, with_key(keycode, shift));
+    text_keycode = keycode;
+    text_shift = shift;
+}
+}  // namespace
+
+void macro_set_macros(const macro_step *const *macro_steps, uint8_t count) {
+    macros = macro_steps;
+    macro_count = count;
+}
+
+void macro_set_mode(uint8_t macro_mode) { mode = macro_mode; }
+
+void macro_report(bt_conn *conn, const keycodes &entry) {
+    if (entry.macro < 0) {
+        live_report = entry;
+
+        if (step && mode == MACRO_MODE_INTERRUPT) {
+            // the live report sent next replaces whatever the macro left pressed on the host
+            hid_drop_queued_reports();
+            stop_macro(true);
+        }
+    }
+
+    defer(entry);
+    send_deferred(conn);
+}
+
+void macro_poll(bt_conn *conn, uint32_t now) {
+    // every step sends at most two reports
+    while (step && hid_report_queue_space() >= 2) {
+        if (delaying) {
+            if (now - delay_start < step->argument) {
+                return;
+            }
+            delaying = false;
+            step++;
+            continue;
+        }
+
+        switch (step->type) {
+            case MACRO_STEP_END:
+                send(conn, {});
+                stop_macro(false);
+                // restore the keys still held on the keyboard
+                if (deferred.empty() && !(live_report.keycodes.empty() &&
+                                          live_report.modifiers.empty())) {
+                    deferred.push_back(live_report);
+                }
+                break;
+            case MACRO_STEP_TAP:
+                send(conn, with_key(step->argument, false));
+                send(conn, macro_keys);
+                step++;
+                break;
+            case MACRO_STEP_PRESS:
+                if (is_modifier(step->argument)) {
+                    macro_keys.modifiers.push_back(step->argument);
+                } else {
+                    macro_keys.keycodes.push_back(step->argument);
+                }
+                send(conn, macro_keys);
+                step++;
+                break;
+            case MACRO_STEP_RELEASE: {
+                key_list &keys =
+                    is_modifier(step->argument) ? macro_keys.modifiers : macro_keys.keycodes;
+                auto found = std::find(keys.begin(), keys.end(), step->argument);
+                if (found != keys.end()) {
+                    keys.erase(found);
+                }
+                send(conn, macro_keys);
+                step++;
+                break;
+            }
+            case MACRO_STEP_TEXT:
+                type_character(conn);
+                break;
+            case MACRO_STEP_DELAY:
+                delaying = true;
+                delay_start = now;
+                break;
+        }
+    }
+
+    send_deferred(conn);
+}
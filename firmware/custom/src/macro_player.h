@@ -0,0 +1,66 @@
+#ifndef MACRO_PLAYER
+#define MACRO_PLAYER
+
+#include <bluetooth/conn.h>
+#include <zephyr.h>
+
+#include "keycode_resolver.h"
+
+enum macro_step_type : uint8_t {
+    MACRO_STEP_END,
+    MACRO_STEP_TAP,      // argument: keycode, tapped on top of the held keys
+    MACRO_STEP_PRESS,    // argument: keycode, held until released or the macro ends
+    MACRO_STEP_RELEASE,  // argument: keycode
+    MACRO_STEP_TEXT,     // text: printable ASCII, newlines and tabs, typed with a US layout
+    MACRO_STEP_DELAY,    // argument: milliseconds
+};
+
+typedef struct macro_step {
+    macro_step_type type;
+    uint16_t argument;
+    const char *text;
+} macro_step;
+
+#define MACRO_TAP(keycode) \
+    { MACRO_STEP_TAP, keycode, nullptr }
+#define MACRO_PRESS(keycode) \
+    { MACRO_STEP_PRESS, keycode, nullptr }
+#define MACRO_RELEASE(keycode) \
+    { MACRO_STEP_RELEASE, keycode, nullptr }
+#define MACRO_TEXT(text) \
+    { MACRO_STEP_TEXT, 0, text }
+#define MACRO_DELAY(ms) \
+    { MACRO_STEP_DELAY, ms, nullptr }
+#define MACRO_END \
+    { MACRO_STEP_END, 0, nullptr }
+
+/**
+ * What happens to keys typed while a macro plays.
+ */
+enum macro_mode : uint8_t {
+    MACRO_MODE_QUEUE,      // typed reports are sent once all queued macros finished
+    MACRO_MODE_INTERRUPT,  // typing stops the macro and drops its unsent reports
+    MACRO_MODE_COUNT,
+};
+
+/**
+ * Sets the macros referenced by MACRO(index) actions, each an array of steps ending with
+ * MACRO_END.
+ */
+void macro_set_macros(const macro_step *const *macros, uint8_t count);
+void macro_set_mode(uint8_t mode);
+
+/**
+ * Hands an entry resolved from the matrix to the player. Reports are sent or deferred depending on
+ * the macro mode, macros start once everything before them was sent. All reports of the keyboard
+ * go through here so they stay in order.
+ */
+void macro_report(bt_conn *conn, const keycodes &report);
+
+/**
+ * Advances the playing macro and sends deferred reports as far as the HID report queue has
+ * space, so a long macro streams at the rate the link sustains. Call on every scan.
+ */
+void macro_poll(bt_conn *conn, uint32_t now);
+
+#endif
@@ -9,100 +9,248 @@
 #include <zephyr.h>
 #include <logging/log.h>
 
-#include <memory>
-#include <string>
-#include <vector>
+#include <algorithm>
 
 #include "battery_reader.h"
 #include "ble_connection_manager.h"
 #include "board_mappings.h"
+#include "energy_counters.h"
+#include "event_trace.h"
 #include "hid.h"
+#include "key_usage.h"
+#include "keyboard_config.h"
 #include "keyboard_matrix_scanner.h"
 #include "keycode_resolver.h"
+#include "keymap.h"
+#include "keystroke_buffer.h"
+#include "keystroke_replay.h"
+#include "macro_player.h"
+#include "perf_counters.h"
+#include "power_governor.h"
+#include "scan_alignment.h"
+#include "scan_rate_governor.h"
+#include "stuck_keys.h"
+#include "tx_power_control.h"
+#include "uart_transport.h"
 
 LOG_MODULE_REGISTER(main);
 
 namespace {
-const uint8_t polling_delay_ms = 2;
-const uint16_t polling_delay_disconnected_ms = 200;
-std::vector<std::pair<uint8_t, uint8_t>> previous_keys;
+// all long lived state is statically allocated, there is no heap
+BatteryReader battery_reader;
+KeyboardMatrixScanner matrix_scanner;
+KeycodeResolver keycode_resolver;
+key_positions previous_keys;
+// uptime of the last change of the pressed keys and of the last scan with a ready connection
+uint32_t last_key_change_ms = 0;
+uint32_t last_connected_ms = 0;
+// upper bound of the delay between scans while disconnected, well below the ~100 ms of a quick
+// tap, so the keystroke that wakes the keyboard is never missed
+const uint16_t max_disconnected_scan_delay_ms = 20;
 
 // battery reading configuration
-uint16_t ms_since_last_battery_report = 0;
-const uint16_t battery_reporting_interval_ms = 30000;
-int16_t button_debounce = 0;
+uint32_t ms_since_last_battery_report = 0;
+int32_t button_debounce = 0;
 }  // namespace
 
-void decrease_button_debounce(uint16_t by) {
+void decrease_button_debounce(uint32_t by) {
     button_debounce = button_debounce - by;
     if (button_debounce < 0) {
         button_debounce = 0;
     }
 }
 
-void main(void) {
-    std::shared_ptr<device> gpio0(device_get_binding("GPIO_0"));
-    std::shared_ptr<device> adc0(device_get_binding("ADC_0"));
-    std::shared_ptr<device> i2c0(device_get_binding("I2C_0"));
+void trace_key_edges(const key_positions &previous, const key_positions &current,
+                     bool record_usage) {
+    for (auto key : current) {
+        if (std::find(previous.begin(), previous.end(), key) == previous.end()) {
+            trace(TRACE_KEY_DOWN, key.first, key.second);
+            if (record_usage) {
+                key_usage_record(key);
+            }
+        }
+    }
 
-    gpio_pin_configure(gpio0.get(), button_pin, GPIO_PULL_UP | GPIO_INPUT);
+    for (auto key : previous) {
+        if (std::find(current.begin(), current.end(), key) == current.end()) {
+            trace(TRACE_KEY_UP, key.first, key.second);
+        }
+    }
+}
 
-    auto battery_reader = std::make_unique<BatteryReader>(
-        adc0, 3700, 3000, 4200, battery_reading_pin_analogue, 1.485, sigmoidal);
-    auto matrix_scanner = std::make_unique<KeyboardMatrixScanner>(gpio0, i2c0, expander_i2c, pins);
-    auto keycode_resolver = std::make_unique<KeycodeResolver>(keycode_matrix, fn_matrix);
+void main(void) {
+    perf_init();
+    perf_boot_mark(BOOT_MAIN);
+    energy_init(&board_energy_model);
 
+    // Bluetooth comes up first: the controller initialises, bonds are loaded and advertising
+    // starts on the system work queue while the hardware below is set up
     settings_subsys_init();
     settings_register(get_paired_conf());
-    ble_init([]() { hid_init(); });
+    settings_register(get_config_conf());
+    settings_register(get_usage_conf());
+    ble_init(hid_init);
+    tx_power_control_init();
+
+    device *gpio0 = device_get_binding("GPIO_0");
+    device *adc0 = device_get_binding("ADC_0");
+    device *i2c0 = device_get_binding("I2C_0");
+    uart_transport_init(device_get_binding("UART_0"));
+
+    gpio_pin_configure(gpio0, button_pin, GPIO_PULL_UP | GPIO_INPUT);
+
+    // set up with the defaults, the stored configuration is applied by the main loop once loaded
+    keyboard_config config = config_get();
+    uint32_t applied_config_generation = config_generation();
+
+    battery_reader.init(adc0, config.battery_ref_voltage, config.battery_min_voltage,
+                        config.battery_max_voltage, battery_reading_pin_analogue,
+                        config.battery_divider_ratio, battery_curve_function(config.battery_curve));
+    matrix_scanner.init(gpio0, i2c0);
+
+    keymap_init(&default_keymap.header);
+    uint32_t applied_keymap_generation = keymap_generation();
+    keycode_resolver.set_keymap(keymap_acquire());
+    keycode_resolver.set_tap_hold(config.tap_hold_flags, config.tapping_term_ms);
+    keycode_resolver.set_combos(default_combos, ARRAY_SIZE(default_combos));
+    keycode_resolver.set_combo_term(config.combo_term_ms);
+    macro_set_macros(default_macros, ARRAY_SIZE(default_macros));
+    macro_set_mode(config.macro_mode);
+    perf_boot_mark(BOOT_HARDWARE_READY);
+
+    settings_load_subtree("config");
+    perf_boot_mark(BOOT_CONFIG_LOADED);
+    settings_load_subtree("usage");
+    key_usage_init();
 
     while (1) {
-        bt_conn *ble_connection = ble_get_connection();
+        const uint32_t loop_start = perf_cycles();
+        // referenced for this iteration, so a disconnect cannot free it while reports are sent
+        bt_conn *ble_connection = ble_ready_to_send() ? ble_acquire_connection() : nullptr;
+
+        if (config_generation() != applied_config_generation) {
+            applied_config_generation = config_generation();
+            config = config_get();
+            battery_reader.configure(config.battery_ref_voltage, config.battery_min_voltage,
+                                      config.battery_max_voltage, config.battery_divider_ratio,
+                                      battery_curve_function(config.battery_curve));
+            keycode_resolver.set_tap_hold(config.tap_hold_flags, config.tapping_term_ms);
+            keycode_resolver.set_combo_term(config.combo_term_ms);
+            macro_set_mode(config.macro_mode);
+            LOG_INF("Applied new configuration");
+        }
+
+        if (keymap_generation() != applied_keymap_generation) {
+            applied_keymap_generation = keymap_generation();
+            keycode_resolver.set_keymap(keymap_acquire());
+            LOG_INF("Applied new keymap");
+        }
 
-        if (ms_since_last_battery_report > battery_reporting_interval_ms) {
+        if (ms_since_last_battery_report > config.battery_reporting_interval_ms) {
+            const uint8_t battery_level = battery_reader.level();
+            power_governor_update(battery_level);
             uint8_t battery_level_stepped_5 =
-                static_cast<uint8_t>(round(battery_reader->level() / 5.0) * 5.0);
+                static_cast<uint8_t>(round(battery_level / 5.0) * 5.0);
             LOG_INF("Battery level (rounded): %d%%", battery_level_stepped_5);
             bt_gatt_bas_set_battery_level(battery_level_stepped_5);
             ms_since_last_battery_report = 0;
         }
 
-        auto reset_connections_pressed = gpio_pin_get(gpio0.get(), button_pin) == 0;
+        auto reset_connections_pressed = gpio_pin_get(gpio0, button_pin) == 0;
         if (reset_connections_pressed) {
             if (button_debounce == 0) {
                 LOG_INF("pressed reset pairing button");
                 reset_paired_device();
             }
-            button_debounce = 500;
+            button_debounce = config.button_debounce_ms;
         } else {
         }
 
-        if (ble_connection) {
-            s64_t time_stamp = k_uptime_get();
-            std::vector<std::pair<uint8_t, uint8_t>> pressed_keys = matrix_scanner->scan_matrix();
-            keycodes keycodes = keycode_resolver->resolve_keycodes(pressed_keys);
-
-            if (pressed_keys != previous_keys) {
-                if (pressed_keys.size() > 0) {
-                    notify_keycodes(ble_connection, keycodes.keycodes, keycodes.modifiers);
-                } else {
-                    notify_keyrelease(ble_connection);
-                }
-                previous_keys = std::move(pressed_keys);
-            }
+        // scanning continues while disconnected, keys typed meanwhile are buffered
+        const bool connected = hid_get_transport() == HID_TRANSPORT_BLE ? ble_connection != nullptr
+                                                                         : hid_transport_ready();
+        s64_t time_stamp = k_uptime_get();
+        const uint32_t scan_start_timestamp = k_cycle_get_32();
+        const uint32_t scan_start = perf_cycles();
+        const bool replaying = keystroke_replay_active();
+        matrix_scan scan = replaying ? keystroke_replay_scan() : matrix_scanner.scan_matrix();
+        const uint32_t scan_cycles = perf_cycles() - scan_start;
+        // replayed keys are no usage of the matrix and never stuck in it
+        if (!replaying && stuck_keys_filter(scan, config.stuck_key_timeout_ms)) {
+            matrix_scanner.set_stuck_keys(stuck_keys_get());
+        }
 
-            const auto delta = static_cast<int>(k_uptime_delta(&time_stamp));
-            k_sleep(K_MSEC(polling_delay_ms));
-            ms_since_last_battery_report = ms_since_last_battery_report + polling_delay_ms + delta;
-            if (!reset_connections_pressed) {
-                decrease_button_debounce(polling_delay_ms + delta);
+        const bool keys_changed = scan.pressed_keys != previous_keys;
+        if (keys_changed) {
+            last_key_change_ms = scan.timestamp;
+        }
+        if (connected) {
+            last_connected_ms = scan.timestamp;
+        }
+
+        // shortly after a disconnect or a key change, keep the full scan rate so nothing typed
+        // while the link comes back is missed
+        const uint32_t now = k_uptime_get_32();
+        const bool reconnecting =
+            now - MAX(last_key_change_ms, last_connected_ms) < keystroke_buffer_max_age_ms;
+        const bool disconnected_wait = !connected && !reconnecting;
+        const uint16_t scan_delay_ms =
+            scan_rate_update(config, keys_changed, disconnected_wait, now);
+        if (keys_changed) {
+            trace(TRACE_SCAN, scan.pressed_keys.size(), scan_cycles);
+            trace_key_edges(previous_keys, scan.pressed_keys, !replaying);
+            uart_transport_mark_scan(scan_start_timestamp, scan.pressed_keys.size());
+        }
+
+        if (connected) {
+            keystroke_buffer_flush(ble_connection, scan.timestamp);
+            for (const keycodes &entry : keycode_resolver.resolve_keycodes(scan)) {
+                macro_report(ble_connection, entry);
             }
+            macro_poll(ble_connection, k_uptime_get_32());
         } else {
-            k_sleep(K_MSEC(polling_delay_disconnected_ms));
-            ms_since_last_battery_report += polling_delay_disconnected_ms;
-            if (!reset_connections_pressed) {
-                decrease_button_debounce(polling_delay_disconnected_ms);
+            for (const keycodes &entry : keycode_resolver.resolve_keycodes(scan)) {
+                keystroke_buffer_push(entry, scan.timestamp);
             }
         }
+        previous_keys = scan.pressed_keys;
+        if (ble_connection) {
+            bt_conn_unref(ble_connection);
+        }
+
+        const auto delta = static_cast<int>(k_uptime_delta(&time_stamp));
+        const uint32_t loop_cycles = perf_cycles() - loop_start;
+        perf_record(PERF_LOOP_ITERATION, loop_cycles);
+        if (replaying) {
+            keystroke_replay_account(loop_cycles, hid_report_queue_depth());
+        }
+
+        uint32_t slept_ms = 0;
+        if (!disconnected_wait) {
+            const uint16_t polling_delay_ms =
+                replaying ? keystroke_replay_scan_delay_ms(config.polling_delay_ms)
+                          : power_governor_scan_delay_ms(scan_delay_ms);
+            // phased to the connection events while reports go out as notifications
+            const bool aligned =
+                connected && !replaying && hid_get_transport() == HID_TRANSPORT_BLE;
+            const uint32_t delay_us =
+                aligned ? scan_alignment_delay_us(polling_delay_ms * 1000,
+                                                  loop_cycles / perf_cycles_per_us)
+                        : polling_delay_ms * 1000;
+            s64_t sleep_start = k_uptime_get();
+            k_sleep(K_USEC(delay_us));
+            slept_ms = k_uptime_delta(&sleep_start);
+        } else {
+            // slower, but still short enough for a tap, ends early once the link is ready
+            s64_t wait_start = k_uptime_get();
+            ble_wait_for_connection(K_MSEC(
+                MIN(config.polling_delay_disconnected_ms, max_disconnected_scan_delay_ms)));
+            slept_ms = k_uptime_delta(&wait_start);
+        }
+
+        ms_since_last_battery_report += slept_ms + delta;
+        if (!reset_connections_pressed) {
+            decrease_button_debounce(slept_ms + delta);
+        }
     }
 }
\ No newline at end of file
@@ -0,0 +1,284 @@
+#include <logging/log.h>
+#include <settings/settings.h>
+#include <shell/shell.h>
+#include <zephyr.h>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include "battery_reader.h"
+#include "board_layout.h"
+#include "event_trace.h"
+#include "hid.h"
+#include "keycode_resolver.h"
+#include "perf_counters.h"
+
+LOG_MODULE_REGISTER(perf_bench);
+
+/**
+ * Microbenchmarks of the hot paths, run on the keyboard itself with "bench run" so the numbers are
+ * the ones of the nRF52 and its compiler flags. Each benchmark takes the fastest of several rounds
+ * with the scheduler locked, interrupts still run. "bench save" stores the results as baseline,
+ * later runs fail if a benchmark got slower than the baseline by more than the tolerance.
+ *
+ * The perf probes and the event trace are not recorded while a benchmark runs, so a run leaves
+ * the measurements of the real workload alone.
+ *
+ * All state is statically allocated and the image contains no heap (the memory_budget target fails
+ * otherwise), so none of the benchmarked paths can allocate.
+ */
+namespace {
+const uint32_t iterations = 1000;
+const uint8_t rounds = 5;
+const uint8_t tolerance_percent = 10;
+const uint16_t bench_min_voltage = 3000;
+const uint16_t bench_max_voltage = 4200;
+
+typedef uint32_t (*bench_fn)(uint8_t param);
+
+typedef struct benchmark {
+    const char *name;
+    bench_fn run;   // returns the cycles of one round of iterations
+    uint8_t param;  // pressed keys or battery curve
+    bool fn;        // hold the first momentary layer key during resolver benchmarks
+} benchmark;
+
+KeycodeResolver bench_resolver;
+volatile uint32_t sink;
+
+// keys with a plain keycode on the base layer, and the position of the first momentary layer key
+key_positions plain_keys;
+std::pair<uint8_t, uint8_t> fn_key;
+bool fn_key_found = false;
+bool fn_held = false;
+
+void find_keys() {
+    plain_keys.clear();
+    fn_key_found = false;
+
+    for (uint8_t row = 0; row < matrix_rows; row++) {
+        for (uint8_t column = 0; column < matrix_columns; column++) {
+            const keymap_action action = keymap_get_action(&default_keymap.header, 0, row, column);
+
+            if (ACTION_TYPE(action) == ACTION_TYPE_MOMENTARY_LAYER && !fn_key_found) {
+                fn_key = std::make_pair(row, column);
+                fn_key_found = true;
+            } else if (ACTION_TYPE(action) == ACTION_TYPE_KEY && action != KC(KEY_NONE) &&
+                       plain_keys.size() < max_pressed_keys - 1) {
+                plain_keys.push_back(std::make_pair(row, column));
+            }
+        }
+    }
+}
+
+// one iteration is a scan with the keys pressed followed by a scan with all keys released
+uint32_t run_resolve(uint8_t keys) {
+    matrix_scan pressed{0, {}};
+    for (uint8_t key = 0; key < keys && key < plain_keys.size(); key++) {
+        pressed.pressed_keys.push_back(plain_keys[key]);
+    }
+    if (fn_held && fn_key_found) {
+        pressed.pressed_keys.push_back(fn_key);
+    }
+    matrix_scan released{0, {}};
+    uint32_t timestamp = 0;
+
+    const uint32_t start = perf_cycles();
+    for (uint32_t iteration = 0; iteration < iterations; iteration++) {
+        pressed.timestamp = timestamp += 2;
+        sink += bench_resolver.resolve_keycodes(pressed).size();
+        released.timestamp = timestamp += 2;
+        sink += bench_resolver.resolve_keycodes(released).size();
+    }
+    return perf_cycles() - start;
+}
+
+uint32_t run_modifiers(uint8_t param) {
+    const key_list modifiers{KEY_LEFTCTRL,  KEY_LEFTSHIFT,  KEY_LEFTALT,  KEY_LEFTMETA,
+                             KEY_RIGHTCTRL, KEY_RIGHTSHIFT, KEY_RIGHTALT, KEY_RIGHTMETA};
+
+    const uint32_t start = perf_cycles();
+    for (uint32_t iteration = 0; iteration < iterations; iteration++) {
+        sink += convert_modifiers_to_bitmask(modifiers);
+    }
+    return perf_cycles() - start;
+}
+
+// without a connection notify_keycodes packs the report and returns before queueing it, only on
+// the BLE transport: the UART transport writes every report
+uint32_t run_notify(uint8_t param) {
+    const key_list keycodes{KEY_A, KEY_S, KEY_D, KEY_F, KEY_J, KEY_K, KEY_L};
+    const key_list modifiers{KEY_LEFTSHIFT, KEY_RIGHTALT};
+
+    const uint32_t start = perf_cycles();
+    for (uint32_t iteration = 0; iteration < iterations; iteration++) {
+        sink += notify_keycodes(nullptr, keycodes, modifiers);
+    }
+    return perf_cycles() - start;
+}
+
+// sweeps the whole voltage range, through the function pointer like BatteryReader does
+uint32_t run_curve(uint8_t curve) {
+    const map_fn map_function = battery_curve_function(curve);
+    const uint16_t range = bench_max_voltage - bench_min_voltage;
+
+    const uint32_t start = perf_cycles();
+    for (uint32_t iteration = 0; iteration < iterations; iteration++) {
+        const uint16_t voltage = bench_min_voltage + iteration % (range + 1);
+        sink += map_function(voltage, bench_min_voltage, bench_max_voltage);
+    }
+    return perf_cycles() - start;
+}
+
+const benchmark benchmarks[] = {
+    {"resolve_0", run_resolve, 0, false},
+    {"resolve_1", run_resolve, 1, false},
+    {"resolve_2", run_resolve, 2, false},
+    {"resolve_6", run_resolve, 6, false},
+    {"resolve_15", run_resolve, 15, false},
+    {"resolve_fn_0", run_resolve, 0, true},
+    {"resolve_fn_1", run_resolve, 1, true},
+    {"resolve_fn_6", run_resolve, 6, true},
+    {"modifiers", run_modifiers, 0, false},
+    {"notify_pack", run_notify, 0, false},
+    {"sigmoidal", run_curve, BATTERY_CURVE_SIGMOIDAL, false},
+    {"asigmoidal", run_curve, BATTERY_CURVE_ASIGMOIDAL, false},
+    {"linear", run_curve, BATTERY_CURVE_LINEAR, false},
+};
+
+const uint8_t benchmark_count = ARRAY_SIZE(benchmarks);
+
+// cycles per iteration of the last run and of the saved baseline, 0 if unknown
+uint32_t results[benchmark_count];
+uint32_t baseline[benchmark_count];
+
+int bench_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg) {
+    const char *next;
+
+    if (settings_name_steq(name, "baseline", &next) && !next) {
+        // a baseline of a different benchmark set can not be compared
+        if (len != sizeof(baseline)) {
+            LOG_WRN("Discarding benchmark baseline of unexpected size %d", len);
+            return 0;
+        }
+
+        const int err = read_cb(cb_arg, baseline, sizeof(baseline));
+        return err < 0 ? err : 0;
+    }
+
+    return -ENOENT;
+}
+
+struct settings_handler bench_conf = {.name = "bench", .h_set = bench_settings_set};
+
+void load_baseline() {
+    static bool registered = false;
+    static bool loaded = false;
+
+    if (!registered) {
+        registered = settings_register(&bench_conf) == 0;
+    }
+    if (registered && !loaded) {
+        loaded = settings_load_subtree("bench") == 0;
+    }
+}
+
+bool available(const benchmark &bench) {
+    return bench.run != run_notify || hid_get_transport() == HID_TRANSPORT_BLE;
+}
+
+uint32_t run_benchmark(const benchmark &bench) {
+    bench_resolver.set_keymap(&default_keymap.header);
+    fn_held = bench.fn;
+
+    uint32_t fastest = std::numeric_limits<uint32_t>::max();
+    k_sched_lock();
+    perf_set_recording(false);
+    trace_set_recording(false);
+    for (uint8_t round = 0; round < rounds; round++) {
+        fastest = std::min(fastest, bench.run(bench.param));
+    }
+    trace_set_recording(true);
+    perf_set_recording(true);
+    k_sched_unlock();
+
+    return fastest / iterations;
+}
+
+int cmd_bench_run(const struct shell *shell, size_t argc, char **argv) {
+    load_baseline();
+    find_keys();
+
+    uint8_t slower = 0;
+    shell_print(shell, "%-14s %10s %10s %10s %6s", "benchmark", "cycles/op", "ns/op", "baseline",
+                "status");
+
+    for (uint8_t index = 0; index < benchmark_count; index++) {
+        const benchmark &bench = benchmarks[index];
+        if (!available(bench)) {
+            results[index] = 0;
+            shell_print(shell, "%-14s %10s %10s %10u %6s", bench.name, "-", "-", baseline[index],
+                        "skip");
+            continue;
+        }
+        results[index] = run_benchmark(bench);
+
+        const char *status = "-";
+        if (baseline[index] != 0) {
+            const bool is_slower =
+                results[index] * 100 > baseline[index] * (100 + tolerance_percent);
+            status = is_slower ? "SLOWER" : "ok";
+            slower += is_slower;
+        }
+
+        shell_print(shell, "%-14s %10u %10u %10u %6s", bench.name, results[index],
+                    results[index] * 1000 / perf_cycles_per_us, baseline[index], status);
+    }
+
+    if (hid_get_transport() != HID_TRANSPORT_BLE) {
+        shell_print(shell, "notify_pack needs the BLE transport, see 'transport ble'");
+    }
+    if (slower > 0) {
+        shell_error(shell, "%u benchmarks are more than %u %% slower than the baseline", slower,
+                    tolerance_percent);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+int cmd_bench_save(const struct shell *shell, size_t argc, char **argv) {
+    load_baseline();
+    if (results[0] == 0) {
+        shell_error(shell, "no results yet, use bench run first");
+        return -EINVAL;
+    }
+
+    memcpy(baseline, results, sizeof(baseline));
+    const int err = settings_save_one("bench/baseline", baseline, sizeof(baseline));
+    if (err) {
+        shell_error(shell, "saving the baseline failed (%d)", err);
+        return err;
+    }
+
+    shell_print(shell, "baseline saved");
+    return 0;
+}
+
+int cmd_bench_clear(const struct shell *shell, size_t argc, char **argv) {
+    load_baseline();
+    memset(baseline, 0, sizeof(baseline));
+    settings_delete("bench/baseline");
+    shell_print(shell, "baseline cleared");
+    return 0;
+}
+}  // namespace
+
+SHELL_STATIC_SUBCMD_SET_CREATE(bench_commands,
+                               SHELL_CMD(run, NULL, "Run all benchmarks and compare them against "
+                                                    "the baseline", cmd_bench_run),
+                               SHELL_CMD(save, NULL, "Store the last results as baseline",
+                                         cmd_bench_save),
+                               SHELL_CMD(clear, NULL, "Delete the baseline", cmd_bench_clear),
+                               SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(bench, &bench_commands, "Hot path microbenchmarks", NULL);
@@ -0,0 +1,235 @@
+#include "perf_counters.h"
+
+#include <bluetooth/gatt.h>
+#include <logging/log.h>
+#include <shell/shell.h>
+
+#include <algorithm>
+#include <array>
+#include <limits>
+
+#include "event_trace.h"
+#include "vendor_uuids.h"
+
+LOG_MODULE_REGISTER(perf);
+
+namespace {
+std::array<perf_stats, PERF_PROBE_COUNT> stats;
+volatile bool recording = true;
+
+const char *const probe_names[PERF_PROBE_COUNT] = {
+    "scan_right", "scan_left", "resolve_keycodes", "notify_keycodes", "battery_voltage", "loop"};
+
+// microseconds since boot per phase, -1 until reached. Not cleared by perf_reset.
+std::array<int32_t, BOOT_PHASE_COUNT> boot_times_us;
+
+const char *const boot_phase_names[BOOT_PHASE_COUNT] = {
+    "main",           "bt_enabled",    "bt_ready",  "bonds_loaded", "advertising",
+    "hardware_ready", "config_loaded", "connected", "secured"};
+
+// GATT representation of a single probe, the histogram saturates at 0xFFFF
+struct perf_stats_record {
+    uint32_t count;
+    uint32_t min_cycles;
+    uint32_t mean_cycles;
+    uint32_t max_cycles;
+    uint16_t histogram[perf_histogram_buckets];
+} __packed;
+
+std::array<perf_stats_record, PERF_PROBE_COUNT> stats_records;
+
+struct bt_uuid_128 perf_service_uuid = VENDOR_UUID_INIT(VENDOR_UUID_PERF_SERVICE);
+struct bt_uuid_128 perf_stats_uuid = VENDOR_UUID_INIT(VENDOR_UUID_PERF_STATS);
+
+uint8_t histogram_bucket(uint32_t cycles) {
+    if (cycles == 0) {
+        return 0;
+    }
+
+    const int log2 = 31 - __builtin_clz(cycles);
+    return std::clamp(log2 - perf_histogram_shift, 0, perf_histogram_buckets - 1);
+}
+
+void clear_stats(perf_stats &probe_stats) {
+    probe_stats = {};
+    probe_stats.min_cycles = std::numeric_limits<uint32_t>::max();
+}
+
+ssize_t read_perf_stats(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf,
+                        uint16_t len, uint16_t offset) {
+    // take a fresh snapshot only at the start of a (long) read, so all parts are consistent
+    if (offset == 0) {
+        for (uint8_t probe = 0; probe < PERF_PROBE_COUNT; probe++) {
+            const perf_stats probe_stats = perf_get(static_cast<perf_probe>(probe));
+            perf_stats_record &record = stats_records[probe];
+
+            record.count = probe_stats.count;
+            record.min_cycles = probe_stats.count ? probe_stats.min_cycles : 0;
+            record.mean_cycles =
+                probe_stats.count ? probe_stats.total_cycles / probe_stats.count : 0;
+            record.max_cycles = probe_stats.max_cycles;
+            for (uint8_t bucket = 0; bucket < perf_histogram_buckets; bucket++) {
+                record.histogram[bucket] =
+                    std::min<uint32_t>(probe_stats.histogram[bucket], UINT16_MAX);
+            }
+        }
+    }
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, stats_records.data(),
+                             sizeof(stats_records));
+}
+
+ssize_t write_perf_stats(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf,
+                         uint16_t len, uint16_t offset, uint8_t flags) {
+    // any write clears the statistics
+    perf_reset();
+    return len;
+}
+
+int cmd_perf_show(const struct shell *shell, size_t argc, char **argv) {
+    shell_print(shell, "%-18s %10s %10s %10s %10s", "probe", "count", "min", "mean", "max");
+
+    for (uint8_t probe = 0; probe < PERF_PROBE_COUNT; probe++) {
+        const perf_stats probe_stats = perf_get(static_cast<perf_probe>(probe));
+        if (probe_stats.count == 0) {
+            shell_print(shell, "%-18s %10u %10s %10s %10s", probe_names[probe], 0, "-", "-", "-");
+            continue;
+        }
+
+        shell_print(shell, "%-18s %10u %10u %10u %10u", probe_names[probe], probe_stats.count,
+                    probe_stats.min_cycles,
+                    static_cast<uint32_t>(probe_stats.total_cycles / probe_stats.count),
+                    probe_stats.max_cycles);
+    }
+
+    shell_print(shell, "(%u cycles per microsecond)", perf_cycles_per_us);
+    return 0;
+}
+
+int cmd_perf_histogram(const struct shell *shell, size_t argc, char **argv) {
+    for (uint8_t probe = 0; probe < PERF_PROBE_COUNT; probe++) {
+        const perf_stats probe_stats = perf_get(static_cast<perf_probe>(probe));
+        shell_print(shell, "%s:", probe_names[probe]);
+
+        for (uint8_t bucket = 0; bucket < perf_histogram_buckets; bucket++) {
+            if (probe_stats.histogram[bucket] > 0) {
+                shell_print(shell, "  >= %7u cycles: %u",
+                            bucket == 0 ? 0 : 1u << (bucket + perf_histogram_shift),
+                            probe_stats.histogram[bucket]);
+            }
+        }
+    }
+
+    return 0;
+}
+
+int cmd_perf_boot(const struct shell *shell, size_t argc, char **argv) {
+    shell_print(shell, "%-18s %12s", "phase", "since boot");
+
+    for (uint8_t phase = 0; phase < BOOT_PHASE_COUNT; phase++) {
+        const int32_t time_us = perf_boot_time_us(static_cast<boot_phase>(phase));
+        if (time_us < 0) {
+            shell_print(shell, "%-18s %12s", boot_phase_names[phase], "-");
+        } else {
+            shell_print(shell, "%-18s %9d.%02d ms", boot_phase_names[phase], time_us / 1000,
+                        (time_us % 1000) / 10);
+        }
+    }
+
+    return 0;
+}
+
+int cmd_perf_reset(const struct shell *shell, size_t argc, char **argv) {
+    perf_reset();
+    shell_print(shell, "performance counters cleared");
+    return 0;
+}
+}  // namespace
+
+BT_GATT_SERVICE_DEFINE(perf_service, BT_GATT_PRIMARY_SERVICE(&perf_service_uuid),
+                       BT_GATT_CHARACTERISTIC(&perf_stats_uuid.uuid,
+                                              BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+                                              BT_GATT_PERM_READ | BT_GATT_PERM_WRITE_ENCRYPT,
+                                              read_perf_stats, write_perf_stats, nullptr));
+
+SHELL_STATIC_SUBCMD_SET_CREATE(perf_commands,
+                               SHELL_CMD(show, NULL, "Show min/mean/max cycles per probe",
+                                         cmd_perf_show),
+                               SHELL_CMD(histogram, NULL, "Show cycle histograms per probe",
+                                         cmd_perf_histogram),
+                               SHELL_CMD(boot, NULL, "Show when each boot phase was reached",
+                                         cmd_perf_boot),
+                               SHELL_CMD(reset, NULL, "Clear all probes", cmd_perf_reset),
+                               SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(perf, &perf_commands, "Hot path cycle counters", NULL);
+
+void perf_init() {
+    boot_times_us.fill(-1);
+
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    perf_reset();
+    LOG_INF("Cycle counter enabled");
+}
+
+void perf_record(perf_probe probe, uint32_t cycles) {
+    if (!recording) {
+        return;
+    }
+
+    const unsigned int key = irq_lock();
+    perf_stats &probe_stats = stats[probe];
+
+    probe_stats.count++;
+    probe_stats.total_cycles += cycles;
+    probe_stats.min_cycles = std::min(probe_stats.min_cycles, cycles);
+    probe_stats.max_cycles = std::max(probe_stats.max_cycles, cycles);
+    probe_stats.histogram[histogram_bucket(cycles)]++;
+
+    irq_unlock(key);
+}
+
+void perf_reset() {
+    const unsigned int key = irq_lock();
+    for (auto &probe_stats : stats) {
+        clear_stats(probe_stats);
+    }
+    irq_unlock(key);
+}
+
+void perf_set_recording(bool enabled) { recording = enabled; }
+
+perf_stats perf_get(perf_probe probe) {
+    const unsigned int key = irq_lock();
+    const perf_stats probe_stats = stats[probe];
+    irq_unlock(key);
+
+    return probe_stats;
+}
+
+void perf_boot_mark(boot_phase phase) {
+    const int32_t time_us = k_cyc_to_us_floor32(k_cycle_get_32());
+
+    const unsigned int key = irq_lock();
+    const bool first = boot_times_us[phase] < 0;
+    if (first) {
+        boot_times_us[phase] = time_us;
+    }
+    irq_unlock(key);
+
+    if (first) {
+        trace(TRACE_BOOT_PHASE, phase, time_us);
+    }
+}
+
+int32_t perf_boot_time_us(boot_phase phase) {
+    const unsigned int key = irq_lock();
+    const int32_t time_us = boot_times_us[phase];
+    irq_unlock(key);
+
+    return time_us;
+}
+
+const char *perf_probe_name(perf_probe probe) { return probe_names[probe]; }
@@ -0,0 +1,96 @@
+#ifndef PERF_COUNTERS
+#define PERF_COUNTERS
+
+#include <arch/arm/aarch32/cortex_m/cmsis.h>
+#include <zephyr.h>
+
+enum perf_probe {
+    PERF_SCAN_RIGHT,
+    PERF_SCAN_LEFT,
+    PERF_RESOLVE_KEYCODES,
+    PERF_NOTIFY_KEYCODES,
+    PERF_BATTERY_VOLTAGE,
+    PERF_LOOP_ITERATION,
+    PERF_PROBE_COUNT
+};
+
+// boot phases in the order they are expected to be reached, see perf_boot_mark
+enum boot_phase {
+    BOOT_MAIN,            // main() entered
+    BOOT_BT_ENABLED,      // bt_enable() returned, controller init continues in the background
+    BOOT_BT_READY,        // Bluetooth stack ready
+    BOOT_BONDS_LOADED,    // bonds and the paired device loaded from settings
+    BOOT_ADVERTISING,     // first advertising started
+    BOOT_HARDWARE_READY,  // ADC, GPIO and scanner configured
+    BOOT_CONFIG_LOADED,   // keyboard configuration loaded from settings
+    BOOT_CONNECTED,       // first connection established
+    BOOT_SECURED,         // first connection encrypted, key reports can be sent
+    BOOT_PHASE_COUNT
+};
+
+// the nRF52 CPU runs at a fixed 64 MHz
+const uint32_t perf_cycles_per_us = 64;
+
+// bucket i counts samples in [2^(i + 5), 2^(i + 6)) cycles, the first and last bucket are open
+const uint8_t perf_histogram_buckets = 16;
+const uint8_t perf_histogram_shift = 5;
+
+typedef struct perf_stats {
+    uint32_t count;
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+    uint64_t total_cycles;
+    uint32_t histogram[perf_histogram_buckets];
+} perf_stats;
+
+/**
+ * Enables the DWT cycle counter and clears all statistics. Needs to be called once at boot before
+ * any probe is recorded.
+ */
+void perf_init();
+
+/**
+ * Returns the current value of the DWT cycle counter. The counter runs at the CPU clock and stops
+ * while the CPU sleeps, so differences measure active CPU time only.
+ */
+static inline uint32_t perf_cycles() { return DWT->CYCCNT; }
+
+void perf_record(perf_probe probe, uint32_t cycles);
+void perf_reset();
+
+/**
+ * Stops or resumes recording to the probes, e.g. while benchmarks run the probed paths. Samples are
+ * dropped while stopped.
+ */
+void perf_set_recording(bool enabled);
+
+perf_stats perf_get(perf_probe probe);
+const char *perf_probe_name(perf_probe probe);
+
+/**
+ * Records the time since boot at which a boot phase was first reached. Later calls for the same
+ * phase are ignored, so reconnects do not overwrite the boot timeline. Safe to call from any
+ * thread.
+ */
+void perf_boot_mark(boot_phase phase);
+
+/**
+ * Returns the microseconds since boot at which the phase was reached, or -1 if it was not reached
+ * yet.
+ */
+int32_t perf_boot_time_us(boot_phase phase);
+
+/**
+ * Records the cycles spent between construction and destruction of the scope to a probe.
+ */
+class PerfScope {
+   private:
+    const perf_probe probe;
+    const uint32_t start;
+
+   public:
+    explicit PerfScope(perf_probe probe) : probe{probe}, start{perf_cycles()} {}
+    ~PerfScope() { perf_record(probe, perf_cycles() - start); }
+};
+
+#endif
@@ -0,0 +1,129 @@
+#include "power_governor.h"
+
+#include <bluetooth/conn.h>
+#include <bluetooth/gatt.h>
+#include <logging/log.h>
+#include <sys/byteorder.h>
+
+#include "ble_connection_manager.h"
+#include "event_trace.h"
+#include "tx_power_control.h"
+#include "vendor_uuids.h"
+
+LOG_MODULE_REGISTER(power_governor);
+
+namespace {
+// the full profile matches CONFIG_BT_PERIPHERAL_PREF_* and CONFIG_BT_CTLR_TX_PWR_PLUS_4. The TX
+// power is the ceiling of the TX power control loop.
+const power_profile_settings profiles[POWER_PROFILE_COUNT] = {
+    {50, 1, 9, 30, 4},
+    {15, 4, 24, 30, 4},
+    {0, 8, 36, 30, 0},
+};
+
+// supervision timeout of all profiles in units of 10 ms
+const uint16_t supervision_timeout = 400;
+// percent the battery needs to be above a threshold before a better profile is used again
+const uint8_t hysteresis_level = 5;
+
+const char *const profile_names[POWER_PROFILE_COUNT] = {"full", "saving", "critical"};
+
+power_profile profile = POWER_PROFILE_FULL;
+uint8_t last_battery_level = 100;
+
+// GATT representation of the active profile and why it was chosen
+struct power_status_record {
+    uint8_t profile;
+    uint8_t battery_level;
+    uint8_t scan_delay_factor;
+    int8_t tx_power_dbm;
+    uint16_t interval;
+    uint16_t latency;
+} __packed;
+
+power_status_record status_record;
+bool status_subscribed = false;
+
+struct bt_uuid_128 power_service_uuid = VENDOR_UUID_INIT(VENDOR_UUID_POWER_SERVICE);
+struct bt_uuid_128 power_status_uuid = VENDOR_UUID_INIT(VENDOR_UUID_POWER_STATUS);
+
+void fill_status_record() {
+    const power_profile_settings &settings = profiles[profile];
+
+    status_record.profile = profile;
+    status_record.battery_level = last_battery_level;
+    status_record.scan_delay_factor = settings.scan_delay_factor;
+    status_record.tx_power_dbm = settings.tx_power_dbm;
+    status_record.interval = sys_cpu_to_le16(settings.interval);
+    status_record.latency = sys_cpu_to_le16(settings.latency);
+}
+
+ssize_t read_power_status(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf,
+                          uint16_t len, uint16_t offset) {
+    if (offset == 0) {
+        fill_status_record();
+    }
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &status_record, sizeof(status_record));
+}
+
+void power_status_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value) {
+    status_subscribed = value == BT_GATT_CCC_NOTIFY;
+}
+
+// the profile a battery level calls for, only moving to a better profile with some margin
+power_profile target_profile(uint8_t battery_level) {
+    uint8_t target = 0;
+    while (target < POWER_PROFILE_COUNT - 1 &&
+           battery_level < profiles[target].min_battery_level) {
+        target++;
+    }
+
+    while (target < profile &&
+           battery_level < profiles[target].min_battery_level + hysteresis_level) {
+        target++;
+    }
+
+    return static_cast<power_profile>(target);
+}
+}  // namespace
+
+BT_GATT_SERVICE_DEFINE(power_service, BT_GATT_PRIMARY_SERVICE(&power_service_uuid),
+                       BT_GATT_CHARACTERISTIC(&power_status_uuid.uuid,
+                                              BT_GATT_CHRC_READ | BT_GATT_CHRC_NOTIFY,
+                                              BT_GATT_PERM_READ, read_power_status, nullptr,
+                                              nullptr),
+                       BT_GATT_CCC(power_status_ccc_changed,
+                                   BT_GATT_PERM_READ | BT_GATT_PERM_WRITE));
+
+void power_governor_update(uint8_t battery_level) {
+    last_battery_level = battery_level;
+
+    const power_profile target = target_profile(battery_level);
+    if (target == profile) {
+        return;
+    }
+
+    LOG_INF("Battery at %d%%, switching from %s to %s power profile", battery_level,
+            profile_names[profile], profile_names[target]);
+    trace(TRACE_POWER_PROFILE, target, battery_level);
+    profile = target;
+
+    const power_profile_settings &settings = profiles[profile];
+    tx_power_set_ceiling(settings.tx_power_dbm);
+    const bt_le_conn_param params =
+        BT_LE_CONN_PARAM_INIT(settings.interval, settings.interval, settings.latency,
+                              supervision_timeout);
+    ble_set_conn_params(params);
+
+    if (status_subscribed) {
+        fill_status_record();
+        bt_gatt_notify(nullptr, &power_service.attrs[2], &status_record, sizeof(status_record));
+    }
+}
+
+power_profile power_governor_profile() { return profile; }
+
+uint16_t power_governor_scan_delay_ms(uint16_t polling_delay_ms) {
+    return polling_delay_ms * profiles[profile].scan_delay_factor;
+}
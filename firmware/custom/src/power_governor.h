@@ -0,0 +1,40 @@
+#ifndef POWER_GOVERNOR
+#define POWER_GOVERNOR
+
+#include <zephyr.h>
+
+/**
+ * Performance profiles the keyboard steps through as the battery drains, from full performance
+ * to the lowest current. The profile only ever gets better again once the battery level is clearly
+ * above the threshold, so a noisy reading does not flip the profile back and forth.
+ */
+enum power_profile : uint8_t {
+    POWER_PROFILE_FULL,
+    POWER_PROFILE_SAVING,    // slower scanning and a longer connection interval
+    POWER_PROFILE_CRITICAL,  // additionally a lower TX power ceiling
+    POWER_PROFILE_COUNT
+};
+
+typedef struct power_profile_settings {
+    uint8_t min_battery_level;  // percent, the next profile is used below
+    uint8_t scan_delay_factor;  // multiplies the configured polling delay
+    uint16_t interval;          // connection interval in units of 1.25 ms
+    uint16_t latency;           // connection events the keyboard may skip
+    int8_t tx_power_dbm;        // highest TX power, see tx_power_set_ceiling
+} power_profile_settings;
+
+/**
+ * Feeds a new battery level (0 - 100) to the governor and switches the profile if needed. Applies
+ * the connection parameters and TX power of a new profile and notifies subscribers of the power
+ * status characteristic. Called by the main loop whenever the battery is read.
+ */
+void power_governor_update(uint8_t battery_level);
+
+power_profile power_governor_profile();
+
+/**
+ * Returns the polling delay of the active profile for the configured delay.
+ */
+uint16_t power_governor_scan_delay_ms(uint16_t polling_delay_ms);
+
+#endif
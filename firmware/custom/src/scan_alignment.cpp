@@ -0,0 +1,55 @@
+#include "scan_alignment.h"
+
+#include "ble_connection_manager.h"
+#include "hid.h"
+
+namespace {
+// from the anchor of a connection event to the acknowledgement of its notification reaching hid
+const uint32_t completion_delay_us = 500;
+// a queued report needs to reach the controller this long before the connection event
+const uint32_t report_margin_us = 500;
+// with a few hundred ppm of sleep clock drift on both sides, older anchors are too far off
+const uint32_t max_anchor_age_us = 1000000;
+
+uint32_t last_completed = 0;
+uint32_t anchor_cycles = 0;  // estimated anchor of a recent connection event
+uint32_t anchor_connection = 0;
+uint32_t interval_us = 0;
+// slowest recent loop iteration, decays slowly so a single fast iteration does not count
+uint32_t work_estimate_us = 0;
+
+// scan period that is not shorter than the polling delay and locked to the connection interval
+uint32_t aligned_period_us(uint32_t polling_delay_us) {
+    if (polling_delay_us <= interval_us) {
+        return interval_us / (interval_us / MAX(polling_delay_us, 1));
+    }
+
+    return interval_us * ((polling_delay_us + interval_us - 1) / interval_us);
+}
+}  // namespace
+
+uint32_t scan_alignment_delay_us(uint32_t polling_delay_us, uint32_t work_us) {
+    work_estimate_us = work_us > work_estimate_us ? work_us
+                                                  : (7 * work_estimate_us + work_us) / 8;
+
+    const hid_link_stats stats = hid_get_link_stats();
+    if (stats.completed != last_completed) {
+        last_completed = stats.completed;
+        anchor_cycles = stats.last_completion_cycles;
+        anchor_connection = ble_connection_generation();
+        interval_us = stats.interval_us;
+    }
+
+    const uint32_t anchor_age_us = k_cyc_to_us_floor32(k_cycle_get_32() - anchor_cycles);
+    if (!interval_us || anchor_connection != ble_connection_generation() ||
+        anchor_age_us > max_anchor_age_us) {
+        return polling_delay_us;
+    }
+
+    // scans start on a grid that puts one of them the lead time before every anchor
+    const uint32_t period_us = aligned_period_us(polling_delay_us);
+    const uint32_t lead_us = work_estimate_us + report_margin_us;
+    const uint32_t since_grid_us = anchor_age_us + completion_delay_us + lead_us;
+
+    return period_us - since_grid_us % period_us;
+}
@@ -0,0 +1,25 @@
+#ifndef SCAN_ALIGNMENT
+#define SCAN_ALIGNMENT
+
+#include <zephyr.h>
+
+/**
+ * Phases the scan loop to the connection events, so a scan and the report it causes finish just
+ * before the next connection event instead of waiting for it.
+ *
+ * The anchors of the connection events are estimated from the acknowledgements of notifications
+ * (see hid_get_link_stats), which arrive shortly after the event they were sent in. The estimate
+ * is refreshed by every report and only used while it is recent, the clocks of both sides drift.
+ */
+
+/**
+ * Returns how long the main loop should sleep before its next scan. Scans keep the polling delay,
+ * rounded up so a whole number of them fits a connection interval, and the one before each
+ * connection event starts early enough for the scan and report to be done in time. Without a
+ * recent estimate the polling delay is returned as is.
+ *
+ * @param work_us time the last loop iteration took from the scan to queueing its reports
+ */
+uint32_t scan_alignment_delay_us(uint32_t polling_delay_us, uint32_t work_us);
+
+#endif
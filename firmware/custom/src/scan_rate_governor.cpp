@@ -0,0 +1,117 @@
+#include "scan_rate_governor.h"
+
+#include <shell/shell.h>
+
+#include "event_trace.h"
+
+namespace {
+// residency buckets are the rates, followed by the time spent waiting for a connection
+const uint8_t disconnected_bucket = SCAN_RATE_COUNT;
+const uint8_t bucket_count = SCAN_RATE_COUNT + 1;
+const char *const bucket_names[bucket_count] = {"active", "idle", "slow", "disconnected"};
+
+scan_rate rate = SCAN_RATE_ACTIVE;
+uint32_t last_change_ms = 0;
+uint32_t last_update_ms = 0;
+uint16_t rate_delay_ms[SCAN_RATE_COUNT] = {};
+
+// residency since the last reset, read by the shell. bucket receives the time until the next
+// update.
+uint64_t residency_ms[bucket_count] = {};
+uint32_t entries[bucket_count] = {};
+uint8_t bucket = SCAN_RATE_ACTIVE;
+struct k_spinlock residency_lock;
+
+scan_rate target_rate(const keyboard_config &config, uint32_t quiet_ms) {
+    if (quiet_ms < config.scan_active_dwell_ms) {
+        return SCAN_RATE_ACTIVE;
+    }
+
+    return quiet_ms < config.scan_active_dwell_ms + config.scan_idle_dwell_ms ? SCAN_RATE_IDLE
+                                                                             : SCAN_RATE_SLOW;
+}
+
+int cmd_scanrate_show(const struct shell *shell, size_t argc, char **argv) {
+    k_spinlock_key_t key = k_spin_lock(&residency_lock);
+    uint64_t snapshot_ms[bucket_count];
+    uint32_t snapshot_entries[bucket_count];
+    const uint8_t current = bucket;
+    uint64_t total_ms = 0;
+    for (uint8_t index = 0; index < bucket_count; index++) {
+        snapshot_ms[index] = residency_ms[index];
+        snapshot_entries[index] = entries[index];
+        total_ms += residency_ms[index];
+    }
+    k_spin_unlock(&residency_lock, key);
+
+    total_ms = total_ms ? total_ms : 1;
+    shell_print(shell, "%-12s %10s %12s %7s %8s", "rate", "delay [ms]", "time [ms]", "share",
+                "entries");
+    for (uint8_t index = 0; index < bucket_count; index++) {
+        // the disconnected wait is set by the main loop, not by the governor
+        const uint32_t delay_ms = index < SCAN_RATE_COUNT ? rate_delay_ms[index] : 0;
+        const uint32_t permille = snapshot_ms[index] * 1000 / total_ms;
+        shell_print(shell, "%-12s %10u %12u %3u.%01u %% %8u%s", bucket_names[index], delay_ms,
+                    static_cast<uint32_t>(snapshot_ms[index]), permille / 10, permille % 10,
+                    snapshot_entries[index], index == current ? " *" : "");
+    }
+    return 0;
+}
+
+int cmd_scanrate_reset(const struct shell *shell, size_t argc, char **argv) {
+    k_spinlock_key_t key = k_spin_lock(&residency_lock);
+    for (uint8_t index = 0; index < bucket_count; index++) {
+        residency_ms[index] = 0;
+        entries[index] = 0;
+    }
+    k_spin_unlock(&residency_lock, key);
+
+    shell_print(shell, "scan rate residency cleared");
+    return 0;
+}
+}  // namespace
+
+SHELL_STATIC_SUBCMD_SET_CREATE(scanrate_commands,
+                               SHELL_CMD(show, NULL, "Show the time spent at each scan rate",
+                                         cmd_scanrate_show),
+                               SHELL_CMD(reset, NULL, "Clear the scan rate residency",
+                                         cmd_scanrate_reset),
+                               SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(scanrate, &scanrate_commands, "Activity driven scan rate", NULL);
+
+uint16_t scan_rate_update(const keyboard_config &config, bool keys_changed, bool disconnected_wait,
+                          uint32_t now_ms) {
+    if (keys_changed) {
+        last_change_ms = now_ms;
+    }
+
+    // never slower than scanning while disconnected
+    rate_delay_ms[SCAN_RATE_ACTIVE] = config.polling_delay_ms;
+    for (uint8_t index = 1; index < SCAN_RATE_COUNT; index++) {
+        rate_delay_ms[index] = MIN(rate_delay_ms[index - 1] * config.scan_rate_step,
+                                   config.polling_delay_disconnected_ms);
+    }
+
+    const scan_rate target = target_rate(config, now_ms - last_change_ms);
+    const uint8_t next_bucket = disconnected_wait ? disconnected_bucket : target;
+
+    k_spinlock_key_t key = k_spin_lock(&residency_lock);
+    if (last_update_ms) {
+        residency_ms[bucket] += now_ms - last_update_ms;
+    }
+    if (next_bucket != bucket) {
+        entries[next_bucket]++;
+    }
+    bucket = next_bucket;
+    k_spin_unlock(&residency_lock, key);
+    last_update_ms = now_ms;
+
+    if (target != rate) {
+        trace(TRACE_SCAN_RATE, target, rate_delay_ms[target]);
+        rate = target;
+    }
+
+    return rate_delay_ms[rate];
+}
+
+scan_rate scan_rate_get() { return rate; }
@@ -0,0 +1,33 @@
+#ifndef SCAN_RATE_GOVERNOR
+#define SCAN_RATE_GOVERNOR
+
+#include <zephyr.h>
+
+#include "keyboard_config.h"
+
+/**
+ * Polling rates of the connected scan loop. The matrix has no interrupt wake, so the loop scans
+ * at the configured polling delay while keys change and steps down to slower rates after a
+ * while without changes (scan_active_dwell_ms, then scan_idle_dwell_ms). Each slower rate
+ * multiplies the delay by scan_rate_step, up to the disconnected polling delay. The first change
+ * returns to the active rate.
+ */
+enum scan_rate : uint8_t {
+    SCAN_RATE_ACTIVE,
+    SCAN_RATE_IDLE,
+    SCAN_RATE_SLOW,
+    SCAN_RATE_COUNT
+};
+
+/**
+ * Feeds the outcome of a scan to the governor and returns the polling delay to use next, before
+ * the power profile is applied. Called by the main loop after every scan. disconnected_wait is
+ * set when the loop waits for a connection instead of using the returned delay, that time is
+ * accounted as disconnected rather than to a rate.
+ */
+uint16_t scan_rate_update(const keyboard_config &config, bool keys_changed, bool disconnected_wait,
+                          uint32_t now_ms);
+
+scan_rate scan_rate_get();
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef STATIC_VECTOR
+#define STATIC_VECTOR
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <initializer_list>
+
+/**
+ * Fixed capacity vector with inline storage, used instead of std::vector so that no state is
+ * allocated on the heap. Elements beyond the capacity are dropped, push_back reports whether the
+ * element was stored.
+ */
+template <typename T, size_t capacity>
+class StaticVector {
+   private:
+    T elements[capacity] = {};
+    size_t count = 0;
+
+   public:
+    StaticVector() = default;
+
+    StaticVector(std::initializer_list<T> values) {
+        for (const T &value : values) {
+            push_back(value);
+        }
+    }
+
+    bool push_back(const T &value) {
+        if (count >= capacity) {
+            return false;
+        }
+
+        elements[count++] = value;
+        return true;
+    }
+
+    T *erase(T *position) {
+        std::copy(position + 1, end(), position);
+        count--;
+        return position;
+    }
+
+    T *erase(T *first, T *last) {
+        std::copy(last, end(), first);
+        count -= last - first;
+        return first;
+    }
+
+    void clear() { count = 0; }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    bool full() const { return count == capacity; }
+
+    T *begin() { return elements; }
+    T *end() { return elements + count; }
+    const T *begin() const { return elements; }
+    const T *end() const { return elements + count; }
+
+    T &front() { return elements[0]; }
+    T &back() { return elements[count - 1]; }
+    const T &front() const { return elements[0]; }
+    const T &back() const { return elements[count - 1]; }
+
+    T &operator[](size_t index) { return elements[index]; }
+    const T &operator[](size_t index) const { return elements[index]; }
+
+    bool operator==(const StaticVector &other) const {
+        return count == other.count && std::equal(begin(), end(), other.begin());
+    }
+
+    bool operator!=(const StaticVector &other) const { return !(*this == other); }
+};
+
+#endif
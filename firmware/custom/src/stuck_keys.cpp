@@ -0,0 +1,72 @@
+#include "stuck_keys.h"
+
+#include <logging/log.h>
+
+#include <algorithm>
+
+#include "event_trace.h"
+
+LOG_MODULE_REGISTER(stuck_keys);
+
+namespace {
+typedef struct held_key {
+    std::pair<uint8_t, uint8_t> position;
+    uint32_t since_ms;
+} held_key;
+
+StaticVector<held_key, max_pressed_keys> held_keys;
+key_positions stuck;
+
+bool contains(const key_positions &keys, std::pair<uint8_t, uint8_t> key) {
+    return std::find(keys.begin(), keys.end(), key) != keys.end();
+}
+}  // namespace
+
+bool stuck_keys_filter(matrix_scan &scan, uint32_t timeout_ms) {
+    bool changed = false;
+
+    // released keys, stuck ones are unmasked again
+    for (auto entry = held_keys.begin(); entry != held_keys.end();) {
+        if (contains(scan.pressed_keys, entry->position)) {
+            entry++;
+            continue;
+        }
+
+        auto stuck_entry = std::find(stuck.begin(), stuck.end(), entry->position);
+        if (stuck_entry != stuck.end()) {
+            LOG_INF("Stuck key %d/%d released after %u s", entry->position.first,
+                    entry->position.second, (scan.timestamp - entry->since_ms) / 1000);
+            trace(TRACE_STUCK_KEY_RELEASED, entry->position.first, entry->position.second);
+            stuck.erase(stuck_entry);
+            changed = true;
+        }
+        entry = held_keys.erase(entry);
+    }
+
+    for (auto key : scan.pressed_keys) {
+        auto entry = std::find_if(held_keys.begin(), held_keys.end(),
+                                  [key](const held_key &held) { return held.position == key; });
+        if (entry == held_keys.end()) {
+            held_keys.push_back({key, scan.timestamp});
+        } else if (timeout_ms && scan.timestamp - entry->since_ms > timeout_ms &&
+                   !contains(stuck, key)) {
+            LOG_WRN("Key %d/%d held for %u s, masking it until released", key.first, key.second,
+                    timeout_ms / 1000);
+            trace(TRACE_STUCK_KEY, key.first, key.second);
+            stuck.push_back(key);
+            changed = true;
+        }
+    }
+
+    if (!stuck.empty()) {
+        auto last = std::remove_if(scan.pressed_keys.begin(), scan.pressed_keys.end(),
+                                   [](std::pair<uint8_t, uint8_t> key) {
+                                       return contains(stuck, key);
+                                   });
+        scan.pressed_keys.erase(last, scan.pressed_keys.end());
+    }
+
+    return changed;
+}
+
+const key_positions &stuck_keys_get() { return stuck; }
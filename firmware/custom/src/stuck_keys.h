@@ -0,0 +1,24 @@
+#ifndef STUCK_KEYS
+#define STUCK_KEYS
+
+#include <zephyr.h>
+
+#include "keyboard_matrix_scanner.h"
+
+/**
+ * Masks keys held far longer than anyone types, e.g. under a book, in a packed bag or from a
+ * shorted switch. A masked key is removed from every scan until it is released, so the host sees
+ * it released and the scan loop can idle again. Masking and release are logged and traced.
+ */
+
+/**
+ * Removes the stuck keys from the scan.
+ *
+ * @param timeout_ms keys held longer are masked, 0 disables the detection
+ * @return whether the set of stuck keys changed, see stuck_keys_get
+ */
+bool stuck_keys_filter(matrix_scan &scan, uint32_t timeout_ms);
+
+const key_positions &stuck_keys_get();
+
+#endif
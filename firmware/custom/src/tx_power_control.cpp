@@ -0,0 +1,144 @@
+#include "tx_power_control.h"
+
+#include <bluetooth/conn.h>
+#include <logging/log.h>
+
+#include "ble_connection_manager.h"
+#include "energy_counters.h"
+#include "event_trace.h"
+#include "hid.h"
+
+LOG_MODULE_REGISTER(tx_power);
+
+namespace {
+typedef struct tx_power_level {
+    int8_t dbm;
+    uint16_t current_permille;  // radio TX current relative to +4 dBm, nRF52832 with DC/DC
+} tx_power_level;
+
+// supported levels, lowest first
+const tx_power_level levels[] = {
+    {-20, 427}, {-16, 440}, {-12, 467}, {-8, 507}, {-4, 560}, {0, 707}, {4, 1000},
+};
+const uint8_t level_count = ARRAY_SIZE(levels);
+
+const uint32_t control_period_ms = 2000;
+// above this the link has enough margin to step down
+const int8_t rssi_comfortable_dbm = -60;
+// below this the power steps up two levels at once
+const int8_t rssi_weak_dbm = -75;
+// a drop of the filtered RSSI by this much since the last step steps up one level
+const int8_t rssi_drop_db = 6;
+// control periods the link needs to be comfortable before each step down
+const uint8_t comfortable_periods = 3;
+
+// only changed on the system work queue, except for the requested ceiling
+uint8_t level = level_count - 1;
+volatile uint8_t ceiling = level_count - 1;
+// level of advertising and of new connections, only ever moved to the ceiling
+uint8_t advertised_level = level_count - 1;
+// connection generation the loop is tracking, see ble_connection_generation
+bool tracking = false;
+uint32_t tracked_connection = 0;
+int16_t rssi_filtered = 0;
+int16_t rssi_at_step = 0;
+uint8_t comfortable_count = 0;
+uint32_t last_slow_completions = 0;
+
+void control_tick(struct k_work *work);
+K_DELAYED_WORK_DEFINE(control_work, control_tick);
+
+uint8_t level_at_or_below(int8_t dbm) {
+    uint8_t index = 0;
+    while (index + 1 < level_count && levels[index + 1].dbm <= dbm) {
+        index++;
+    }
+    return index;
+}
+
+void set_level(uint8_t new_level) {
+    new_level = MIN(new_level, ceiling);
+    comfortable_count = 0;
+    rssi_at_step = rssi_filtered;
+
+    // steps below the ceiling only change the connection
+    const bool at_ceiling = new_level == ceiling;
+    if (new_level == level && (!at_ceiling || advertised_level == new_level)) {
+        return;
+    }
+
+    // on failure the level stays, so the next step starts from the power actually in use
+    if (ble_set_tx_power(levels[new_level].dbm, !at_ceiling)) {
+        return;
+    }
+
+    if (at_ceiling) {
+        advertised_level = new_level;
+    }
+    level = new_level;
+    energy_set_tx_current_permille(levels[level].current_permille);
+    LOG_DBG("TX power %d dBm at RSSI %d dBm", levels[level].dbm, rssi_filtered);
+    trace(TRACE_TX_POWER, levels[level].dbm, rssi_filtered);
+}
+
+void control_tick(struct k_work *work) {
+    k_delayed_work_submit(&control_work, K_MSEC(control_period_ms));
+
+    int8_t rssi = 0;
+    if (ble_read_rssi(&rssi)) {
+        // not connected, the next connection starts at full power
+        if (tracking || level != ceiling) {
+            tracking = false;
+            set_level(ceiling);
+        }
+        return;
+    }
+
+    const uint32_t slow_completions = hid_get_link_stats().slow_completions;
+    if (!tracking || tracked_connection != ble_connection_generation()) {
+        // a new connection starts at the ceiling, whatever the previous one ended at
+        set_level(ceiling);
+        tracking = true;
+        tracked_connection = ble_connection_generation();
+        rssi_filtered = rssi;
+        rssi_at_step = rssi;
+        comfortable_count = 0;
+        last_slow_completions = slow_completions;
+    }
+
+    rssi_filtered = (3 * rssi_filtered + rssi) / 4;
+    const bool retransmitted = slow_completions != last_slow_completions;
+    last_slow_completions = slow_completions;
+
+    if (level > ceiling) {
+        set_level(ceiling);
+    } else if (retransmitted || rssi_filtered < rssi_weak_dbm) {
+        set_level(level + 2);
+    } else if (rssi_filtered < rssi_at_step - rssi_drop_db) {
+        set_level(level + 1);
+    } else if (rssi_filtered > rssi_comfortable_dbm && level > 0 &&
+               ++comfortable_count >= comfortable_periods) {
+        set_level(level - 1);
+    }
+}
+
+void control_disconnected(struct bt_conn *conn, u8_t reason) {
+    // back to the ceiling right away instead of at the next period, the HCI commands block, so
+    // not from the Bluetooth RX thread
+    k_delayed_work_submit(&control_work, K_NO_WAIT);
+}
+
+struct bt_conn_cb control_conn_callbacks = {.disconnected = control_disconnected};
+}  // namespace
+
+void tx_power_control_init() {
+    bt_conn_cb_register(&control_conn_callbacks);
+    k_delayed_work_submit(&control_work, K_MSEC(control_period_ms));
+}
+
+void tx_power_set_ceiling(int8_t dbm) {
+    ceiling = level_at_or_below(dbm);
+    k_delayed_work_submit(&control_work, K_NO_WAIT);
+}
+
+int8_t tx_power_dbm() { return levels[level].dbm; }
@@ -0,0 +1,28 @@
+#ifndef TX_POWER_CONTROL
+#define TX_POWER_CONTROL
+
+#include <zephyr.h>
+
+/**
+ * Closed loop TX power control of the connection. Every control period the RSSI of the host is
+ * read; the power steps down one level while the link is comfortably strong and steps back up as
+ * soon as the RSSI falls or notifications needed retransmissions (see hid_get_link_stats). The
+ * path loss is assumed to be about the same in both directions.
+ *
+ * New connections and advertising always start at the ceiling, the loop returns to it as soon as
+ * a connection ends. Runs on the system work queue.
+ */
+void tx_power_control_init();
+
+/**
+ * Sets the highest TX power the control loop may use, e.g. lowered by the power governor. The
+ * closest supported level at or below is used and applied right away.
+ */
+void tx_power_set_ceiling(int8_t dbm);
+
+/**
+ * Returns the TX power of the connection in dBm.
+ */
+int8_t tx_power_dbm();
+
+#endif
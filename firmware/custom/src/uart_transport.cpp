@@ -0,0 +1,93 @@
+#include "uart_transport.h"
+
+#include <drivers/uart.h>
+#include <logging/log.h>
+#include <shell/shell.h>
+#include <sys/byteorder.h>
+#include <sys/crc.h>
+
+#include "hid.h"
+
+LOG_MODULE_REGISTER(uart_transport);
+
+namespace {
+const uint8_t frame_sync[] = {0x55, 0xAA};
+// type, sequence, timestamp and the largest payload
+const uint8_t max_frame_body = 1 + 1 + 4 + 8;
+
+device *uart = nullptr;
+uint8_t sequence = 0;
+// frames are written byte by byte and must not interleave
+K_MUTEX_DEFINE(frame_lock);
+
+int write_frame(uart_frame_type type, uint32_t timestamp, const uint8_t *payload, uint8_t len) {
+    if (!uart) {
+        return -ENODEV;
+    }
+    if (len > max_frame_body - 6) {
+        return -EINVAL;
+    }
+
+    uint8_t body[max_frame_body];
+    k_mutex_lock(&frame_lock, K_FOREVER);
+    body[0] = type;
+    body[1] = sequence++;
+    sys_put_le32(timestamp, &body[2]);
+    memcpy(&body[6], payload, len);
+    const uint8_t crc = crc8_ccitt(0xFF, body, 6 + len);
+
+    for (uint8_t byte : frame_sync) {
+        uart_poll_out(uart, byte);
+    }
+    for (uint8_t index = 0; index < 6 + len; index++) {
+        uart_poll_out(uart, body[index]);
+    }
+    uart_poll_out(uart, crc);
+    k_mutex_unlock(&frame_lock);
+
+    return 0;
+}
+
+int cmd_transport_show(const struct shell *shell, size_t argc, char **argv) {
+    shell_print(shell, "reports go over %s",
+                hid_get_transport() == HID_TRANSPORT_UART ? "uart" : "ble");
+    return 0;
+}
+
+int cmd_transport_ble(const struct shell *shell, size_t argc, char **argv) {
+    hid_set_transport(HID_TRANSPORT_BLE);
+    return cmd_transport_show(shell, argc, argv);
+}
+
+int cmd_transport_uart(const struct shell *shell, size_t argc, char **argv) {
+    if (!uart) {
+        shell_error(shell, "no uart");
+        return -ENODEV;
+    }
+
+    hid_set_transport(HID_TRANSPORT_UART);
+    return cmd_transport_show(shell, argc, argv);
+}
+}  // namespace
+
+SHELL_STATIC_SUBCMD_SET_CREATE(transport_commands,
+                               SHELL_CMD(show, NULL, "Show the active report transport",
+                                         cmd_transport_show),
+                               SHELL_CMD(ble, NULL, "Send reports as BLE notifications",
+                                         cmd_transport_ble),
+                               SHELL_CMD(uart, NULL, "Send reports as frames on this uart",
+                                         cmd_transport_uart),
+                               SHELL_SUBCMD_SET_END);
+SHELL_CMD_REGISTER(transport, &transport_commands, "Keyboard report transport", NULL);
+
+void uart_transport_init(device *uart) { ::uart = uart; }
+
+int uart_transport_send_report(const uint8_t *report, uint8_t len) {
+    return write_frame(UART_FRAME_REPORT, k_cycle_get_32(), report, len);
+}
+
+void uart_transport_mark_scan(uint32_t scan_start_cycles, uint8_t pressed_keys) {
+    if (hid_get_transport() == HID_TRANSPORT_UART) {
+        write_frame(UART_FRAME_SCAN, scan_start_cycles, &pressed_keys, 1);
+    }
+}
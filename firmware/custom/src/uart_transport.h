@@ -0,0 +1,34 @@
+#ifndef UART_TRANSPORT
+#define UART_TRANSPORT
+
+#include <device.h>
+#include <zephyr.h>
+
+/**
+ * Radio free report transport for latency measurements and stress tests, see tools/uart_latency.py.
+ * Keyboard reports and the scans that caused them are written as frames to the console UART,
+ * mixed with the log and shell output:
+ *
+ *     0x55 0xAA | type | sequence | timestamp (4) | payload | CRC-8 (CCITT) of type to payload
+ *
+ * Little endian, the timestamp is in hardware cycles (CONFIG_SYS_CLOCK_HW_CYCLES_PER_SEC) and the
+ * sequence number counts all frames, so the host notices lost frames.
+ */
+enum uart_frame_type : uint8_t {
+    UART_FRAME_SCAN = 0x01,    // payload: number of pressed keys, timestamp: start of the scan
+    UART_FRAME_REPORT = 0x02,  // payload: the 8 byte keyboard report, timestamp: when sent
+};
+
+void uart_transport_init(device *uart);
+
+/**
+ * Writes a report frame, blocks until the frame is in the UART.
+ */
+int uart_transport_send_report(const uint8_t *report, uint8_t len);
+
+/**
+ * Writes a scan frame for a scan that changed the pressed keys, if the UART transport is active.
+ */
+void uart_transport_mark_scan(uint32_t scan_start_cycles, uint8_t pressed_keys);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef VENDOR_UUIDS
+#define VENDOR_UUIDS
+
+#include <bluetooth/uuid.h>
+
+/**
+ * 128-bit UUIDs of the vendor specific GATT services and characteristics. All of them share the
+ * base a71bxxxx-3f11-5ea2-9b47-418d1e625a3c, with the 16-bit id filling in the xxxx part.
+ */
+#define VENDOR_UUID_INIT(id)                                                                   \
+    BT_UUID_INIT_128(0x3c, 0x5a, 0x62, 0x1e, 0x8d, 0x41, 0x47, 0x9b, 0xa2, 0x5e, 0x11, 0x3f, \
+                     ((id)&0xFF), (((id) >> 8) & 0xFF), 0x1b, 0xa7)
+
+// performance counters
+#define VENDOR_UUID_PERF_SERVICE 0x0100
+#define VENDOR_UUID_PERF_STATS 0x0101
+
+// runtime configuration
+#define VENDOR_UUID_CONFIG_SERVICE 0x0200
+#define VENDOR_UUID_CONFIG_BLOCK 0x0201
+
+// keymap upload
+#define VENDOR_UUID_KEYMAP_SERVICE 0x0300
+#define VENDOR_UUID_KEYMAP_CONTROL 0x0301
+#define VENDOR_UUID_KEYMAP_DATA 0x0302
+#define VENDOR_UUID_KEYMAP_STATUS 0x0303
+
+// energy accounting
+#define VENDOR_UUID_ENERGY_SERVICE 0x0400
+#define VENDOR_UUID_ENERGY_STATS 0x0401
+
+// key usage counters
+#define VENDOR_UUID_USAGE_SERVICE 0x0500
+#define VENDOR_UUID_USAGE_COUNTS 0x0501
+
+// battery power governor
+#define VENDOR_UUID_POWER_SERVICE 0x0600
+#define VENDOR_UUID_POWER_STATUS 0x0601
+
+#endif
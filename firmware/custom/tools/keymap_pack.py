@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+"""
+Packs a JSON keymap into the binary keymap image format described in src/keymap.h.
+
+The JSON file contains a list of layers, each a list of rows of action names, e.g.
+
+    {"layers": [[["KEY_ESC", "KEY_1", ...], ...], [["KEY_NONE", "KEY_F1", ...], ...]]}
+
+Actions are either keycode names from src/usb_hid_keys.h, MO(<layer>), MT(<modifier>, <keycode>),
+LT(<layer>, <keycode>), MACRO(<macro>) or plain integers.
+"""
+
+import argparse
+import binascii
+import json
+import pathlib
+import re
+import struct
+
+KEYMAP_MAGIC = 0x4D4B5741
+KEYMAP_VERSION = 1
+HEADER_FORMAT = "<IBBBBIII"
+
+ACTION_TYPE_MOMENTARY_LAYER = 0x1
+ACTION_TYPE_MOD_TAP = 0x2
+ACTION_TYPE_LAYER_TAP = 0x3
+ACTION_TYPE_MACRO = 0x4
+
+
+def read_keycodes(header):
+    keycodes = {}
+    for match in re.finditer(r"#define\s+(KEY_\w+)\s+(0x[0-9a-fA-F]+|\d+)", header.read_text()):
+        keycodes[match.group(1)] = int(match.group(2), 0)
+    return keycodes
+
+
+def parse_action(action, keycodes):
+    if isinstance(action, int):
+        return action
+
+    match = re.fullmatch(r"MO\((\d+)\)", action)
+    if match:
+        return (ACTION_TYPE_MOMENTARY_LAYER << 12) | int(match.group(1))
+
+    match = re.fullmatch(r"MACRO\((\d+)\)", action)
+    if match:
+        return (ACTION_TYPE_MACRO << 12) | int(match.group(1))
+
+    match = re.fullmatch(r"MT\((\w+),\s*(\w+)\)", action)
+    if match:
+        modifier = parse_action(match.group(1), keycodes) - keycodes["KEY_LEFTCTRL"]
+        if not 0 <= modifier <= 7:
+            raise ValueError(f"{match.group(1)} is not a modifier")
+        return (ACTION_TYPE_MOD_TAP << 12) | (modifier << 8) | parse_action(match.group(2), keycodes)
+
+    match = re.fullmatch(r"LT\((\d+),\s*(\w+)\)", action)
+    if match:
+        return ((ACTION_TYPE_LAYER_TAP << 12) | (int(match.group(1)) << 8) |
+                parse_action(match.group(2), keycodes))
+
+    if action not in keycodes:
+        raise ValueError(f"unknown action {action}")
+    return keycodes[action]
+
+
+def pack(layers, keycodes):
+    rows = len(layers[0])
+    columns = len(layers[0][0])
+    actions = []
+
+    for layer in layers:
+        if len(layer) != rows or any(len(row) != columns for row in layer):
+            raise ValueError("all layers need to have the same dimensions")
+        for row in layer:
+            actions.extend(parse_action(action, keycodes) for action in row)
+
+    table = struct.pack(f"<{len(actions)}H", *actions)
+    length = struct.calcsize(HEADER_FORMAT) + len(table)
+    header = struct.pack(HEADER_FORMAT, KEYMAP_MAGIC, KEYMAP_VERSION, len(layers), rows, columns,
+                         length, 0, binascii.crc32(table))
+    return header + table
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("keymap", type=pathlib.Path, help="JSON keymap")
+    parser.add_argument("output", type=pathlib.Path, help="binary keymap image")
+    parser.add_argument("--keycodes", type=pathlib.Path,
+                        default=pathlib.Path(__file__).parent.parent / "src" / "usb_hid_keys.h")
+    args = parser.parse_args()
+
+    image = pack(json.loads(args.keymap.read_text())["layers"], read_keycodes(args.keycodes))
+    args.output.write_bytes(image)
+    print(f"wrote {len(image)} bytes to {args.output}")
+
+
+if __name__ == "__main__":
+    main()
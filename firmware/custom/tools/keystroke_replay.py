@@ -0,0 +1,236 @@
+#!/usr/bin/env python3
+"""
+Replays recorded keystroke timelines on the keyboard and checks the resulting report stream.
+
+The timeline is loaded with the 'replay' shell command and replayed in place of the matrix
+through the resolver and report path, reports come back as frames of the UART transport (see
+uart_latency.py). Every run checks that
+  - each change of the held keys was scanned, in order and without lost frames
+  - reports are in order and the stream ends with an empty report (no lost releases)
+  - no report has all six keycode slots used while more keys are held (sixth key truncation)
+and prints reports/s, CPU time per event and the replay lag.
+
+With --transport ble the reports go to the connected host instead, where they are typed and not
+checked. The peak depth of the BLE report queue is printed in place of reports/s.
+
+Timelines are text files, one event per line as 'milliseconds,row,column,pressed', e.g.
+    0,2,3,1
+    85,2,3,0
+or the 'key down' and 'key up' lines of trace_decode.py. Needs pyserial:
+    keystroke_replay.py --port /dev/ttyACM0 --speed 100 --speed 1000 typist.csv
+    keystroke_replay.py --port /dev/ttyACM0 --transport ble typist.csv
+"""
+
+import argparse
+import re
+import sys
+import time
+
+from uart_latency import FRAME_REPORT, FRAME_SCAN, parse_frames
+
+# events the keyboard holds per run, longer timelines are split where no key is held
+REPLAY_CAPACITY = 256
+
+TRACE_EVENT = re.compile(r"([\d.]+) ms\s+key (down|up)\s+row=(\d+) column=(\d+)")
+STATS = re.compile(r"replay (\w+) events=(\d+)/(\d+) loops=(\d+) cycles_per_event=(\d+) "
+                   r"peak_queue=(\d+) lag_ms=(\d+) elapsed_ms=(\d+)")
+CYCLES_PER_US = re.compile(r"\((\d+) cycles per microsecond\)")
+
+
+def load_timeline(lines):
+    events = []
+    for line in lines:
+        line = line.strip()
+        match = TRACE_EVENT.search(line)
+        if match:
+            events.append((round(float(match[1])), int(match[3]), int(match[4]),
+                           match[2] == "down"))
+        elif line and not line.startswith("#"):
+            at_ms, row, column, pressed = (int(field) for field in line.split(","))
+            events.append((at_ms, row, column, pressed != 0))
+
+    first = events[0][0] if events else 0
+    return sorted(((at_ms - first, row, column, pressed)
+                   for at_ms, row, column, pressed in events), key=lambda event: event[0])
+
+
+def split_timeline(events):
+    """Splits the timeline into parts that fit the keyboard, each starting with no key held."""
+    parts = []
+    held = set()
+    start = 0
+    last_idle = 0
+    for index, (_, row, column, pressed) in enumerate(events):
+        if index - start >= REPLAY_CAPACITY:
+            if last_idle == start:
+                sys.exit(f"more than {REPLAY_CAPACITY} events without all keys released")
+            parts.append(events[start:last_idle])
+            start = last_idle
+        (held.add if pressed else held.discard)((row, column))
+        if not held:
+            last_idle = index + 1
+    parts.append(events[start:])
+
+    # every part starts at 0 ms
+    return [[(at_ms - part[0][0], row, column, pressed)
+             for at_ms, row, column, pressed in part] for part in parts if part]
+
+
+def expected_scans(events):
+    """Returns the number of held keys after each change, as the scan frames report them."""
+    counts = []
+    held = []  # in the order the keyboard keeps them, a scan is sent whenever it changes
+    index = 0
+    while index < len(events):
+        at_ms = events[index][0]
+        before = list(held)
+        while index < len(events) and events[index][0] == at_ms:
+            _, row, column, pressed = events[index]
+            if pressed and (row, column) not in held:
+                held.append((row, column))
+            elif not pressed and (row, column) in held:
+                held.remove((row, column))
+            index += 1
+        if held != before:
+            counts.append(len(held))
+    if held:
+        counts.append(0)
+    return counts
+
+
+def check_stream(frames, expected):
+    problems = []
+    scans = []
+    held_keys = 0
+    truncated = 0
+    last_report = None
+    last_sequence = None
+    last_timestamp = None
+
+    for frame_type, sequence, timestamp, payload in frames:
+        if last_sequence is not None and sequence != (last_sequence + 1) & 0xFF:
+            problems.append(f"{(sequence - last_sequence - 1) & 0xFF} frames lost")
+        if last_timestamp is not None and (timestamp - last_timestamp) & 0x80000000:
+            problems.append(f"frame {sequence} is older than the one before")
+        last_sequence = sequence
+        last_timestamp = timestamp
+
+        if frame_type == FRAME_SCAN:
+            held_keys = payload[0]
+            scans.append(held_keys)
+        elif frame_type == FRAME_REPORT:
+            last_report = payload
+            if all(payload[2:8]) and held_keys > 6:
+                truncated += 1
+
+    if scans != expected:
+        mismatch = next((index for index, (seen, wanted) in enumerate(zip(scans, expected))
+                         if seen != wanted), min(len(scans), len(expected)))
+        problems.append(f"scans differ from the timeline at change {mismatch} "
+                        f"({len(scans)} scanned, {len(expected)} expected)")
+    if last_report is None:
+        problems.append("no reports")
+    elif any(last_report):
+        problems.append(f"the stream ends with keys held: {last_report.hex()}")
+    if truncated:
+        problems.append(f"{truncated} reports with six keycodes while more keys were held")
+
+    return problems
+
+
+class Keyboard:
+    def __init__(self, port, baudrate):
+        import serial
+
+        self.connection = serial.Serial(port, baudrate, timeout=0.05)
+        self.received = bytearray()
+
+    def read(self, quiet_s=0.05):
+        """Reads until the keyboard stays quiet, returns everything received since the last call."""
+        start = len(self.received)
+        last_data = time.monotonic()
+        while time.monotonic() - last_data < quiet_s:
+            data = self.connection.read(4096)
+            if data:
+                self.received += data
+                last_data = time.monotonic()
+        return self.received[start:]
+
+    def command(self, line):
+        self.connection.write(line.encode() + b"\n")
+        return self.read().decode(errors="replace")
+
+    def replay(self, events, speed):
+        self.command("replay clear")
+        for at_ms, row, column, pressed in events:
+            output = self.command(f"replay add {at_ms} {row} {column} {int(pressed)}")
+            if "invalid" in output or "no room" in output:
+                sys.exit(f"the keyboard rejected an event: {output.strip()}")
+
+        self.received.clear()
+        self.command(f"replay run {speed}")
+        # shell output shares the UART with the frames and would corrupt them, so the stats are
+        # only asked for once the replay had the time to finish and the frames stopped
+        time.sleep(events[-1][0] / 1000 * 100 / speed if events else 0)
+        while True:
+            self.read(quiet_s=0.5)
+            output = self.command("replay stats")
+            stats = STATS.search(output)
+            if stats and stats[1] == "done":
+                break
+
+        cycles_per_us = CYCLES_PER_US.search(output)
+        return parse_frames(self.received), stats, int(cycles_per_us[1]) if cycles_per_us else 64
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("timeline", type=argparse.FileType("r"))
+    parser.add_argument("--port", required=True, help="serial port of the keyboard console")
+    parser.add_argument("--baudrate", type=int, default=115200)
+    parser.add_argument("--speed", type=int, action="append",
+                        help="replay speed in percent of the recording, repeatable (default 100)")
+    parser.add_argument("--transport", choices=["uart", "ble"], default="uart",
+                        help="report path, over BLE the stream is not checked (default uart)")
+    args = parser.parse_args()
+
+    parts = split_timeline(load_timeline(args.timeline))
+    keyboard = Keyboard(args.port, args.baudrate)
+    keyboard.command(f"transport {args.transport}")
+
+    failed = False
+    for speed in args.speed or [100]:
+        reports = events = cycles = loops = peak_queue = lag_ms = elapsed_ms = 0
+        cycles_per_us = 64
+        for index, part in enumerate(parts):
+            frames, stats, cycles_per_us = keyboard.replay(part, speed)
+            if args.transport == "uart":
+                frames = list(frames)
+                for problem in check_stream(frames, expected_scans(part)):
+                    print(f"{speed} %, part {index}: {problem}")
+                    failed = True
+                reports += sum(frame[0] == FRAME_REPORT for frame in frames)
+
+            events += int(stats[2])
+            loops += int(stats[4])
+            cycles += int(stats[5]) * int(stats[2])
+            peak_queue = max(peak_queue, int(stats[6]))
+            lag_ms += int(stats[7])
+            elapsed_ms += int(stats[8])
+
+        if args.transport == "uart":
+            throughput = (f"{reports} reports in {elapsed_ms} ms "
+                          f"({reports * 1000 / max(elapsed_ms, 1):.1f} reports/s)")
+        else:
+            throughput = f"peak queue {peak_queue} reports in {elapsed_ms} ms"
+        print(f"{speed} %: {events} events, {throughput}, "
+              f"{cycles / max(events, 1) / cycles_per_us:.1f} us CPU per event over {loops} "
+              f"loops, lag {lag_ms} ms")
+
+    keyboard.command("transport ble")
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,205 @@
+#!/usr/bin/env python3
+"""
+Generates the board layout header (matrix pins, port masks, matrix transform and default keymap)
+from a layout file in layouts/. Runs at CMake configure time, see zephyr/CMakeLists.txt.
+
+The layout file holds everything the firmware needs to know about a board:
+
+    {
+        "kle": "path/to/keyboard-layout.json",
+        "pins": {"rows_left": [...], "columns_left": [...], "rows_right": [...],
+                 "columns_right": [...]},
+        "battery_reading_pin_analogue": 2, "expander": "mcp23017", "expander_i2c": 32,
+        "button_pin": 3,
+        "transform": [[[row, column], ...], ...],
+        "layers": [[["KEY_ESC", ...], ...], ...]
+    }
+
+"layers" is a list of layers of matrix rows in the format of tools/keymap_pack.py, so a layout
+file can be packed into a keymap image directly. "transform" gives the matrix position of every
+key of the KLE (keyboard-layout-editor.com) layout, one list per KLE row. Matrix positions without
+a physical key have to be KEY_NONE on all layers. Without "kle" every matrix position is a key.
+"expander" selects the I/O expander driver of the left half, see src/io_expander.h.
+"""
+
+import argparse
+import json
+import pathlib
+import sys
+
+sys.path.insert(0, str(pathlib.Path(__file__).parent))
+import keymap_pack  # noqa: E402
+
+# pins per side the scanner supports, and ports the pins live on
+MAX_PINS_PER_SIDE = 8
+LEFT_PORT_PINS = 8
+RIGHT_PORT_PINS = 32
+
+# expander parts and the driver class in src/io_expander.h
+EXPANDER_DRIVERS = {"mcp23017": "Mcp23017", "pca9555": "Pca9555", "tca9555": "Pca9555"}
+
+
+def kle_rows(kle):
+    """Returns the number of keys in each row of a KLE layout."""
+    return [sum(isinstance(item, str) for item in row) for row in kle if isinstance(row, list)]
+
+
+def check_pins(pins, rows, columns):
+    for side, port_pins in (("left", LEFT_PORT_PINS), ("right", RIGHT_PORT_PINS)):
+        for kind in ("rows", "columns"):
+            values = pins[f"{kind}_{side}"]
+            if len(values) > MAX_PINS_PER_SIDE:
+                raise ValueError(f"{kind}_{side}: at most {MAX_PINS_PER_SIDE} pins are supported")
+            if len(set(values)) != len(values) or any(not 0 <= pin < port_pins for pin in values):
+                raise ValueError(f"{kind}_{side}: pins need to be unique and below {port_pins}")
+
+    if len(pins["rows_left"]) != rows or len(pins["rows_right"]) != rows:
+        raise ValueError(f"both halves need {rows} row pins")
+    if len(pins["columns_left"]) + len(pins["columns_right"]) != columns:
+        raise ValueError(f"the halves need {columns} column pins together")
+
+
+def check_transform(layout, layout_file, layers, rows, columns):
+    if "kle" not in layout:
+        return [(row, column) for row in range(rows) for column in range(columns)]
+
+    kle = json.loads((layout_file.parent / layout["kle"]).read_text())
+    transform = layout["transform"]
+    if [len(row) for row in transform] != kle_rows(kle):
+        raise ValueError(f"transform rows need to match the KLE rows {kle_rows(kle)}")
+
+    positions = [tuple(position) for row in transform for position in row]
+    if len(set(positions)) != len(positions):
+        raise ValueError("transform maps two keys to the same matrix position")
+    for row, column in positions:
+        if not (0 <= row < rows and 0 <= column < columns):
+            raise ValueError(f"transform position ({row}, {column}) is outside the matrix")
+
+    for layer_index, layer in enumerate(layers):
+        for row in range(rows):
+            for column in range(columns):
+                if (row, column) not in positions and layer[row][column] != "KEY_NONE":
+                    raise ValueError(f"layer {layer_index} assigns {layer[row][column]} to "
+                                     f"({row}, {column}) which has no physical key")
+
+    return positions
+
+
+def mask(pins):
+    value = 0
+    for pin in pins:
+        value |= 1 << pin
+    return value
+
+
+def c_list(values):
+    return "{" + ", ".join(str(value) for value in values) + "}"
+
+
+def generate(layout_file, keycodes):
+    layout = json.loads(layout_file.read_text())
+    layers = layout["layers"]
+    rows = len(layers[0])
+    columns = len(layers[0][0])
+    pins = layout["pins"]
+
+    # validates the actions and the dimensions of all layers
+    keymap_pack.pack(layers, keycodes)
+    check_pins(pins, rows, columns)
+    transform = check_transform(layout, layout_file, layers, rows, columns)
+    expander = layout.get("expander", "mcp23017")
+    if expander not in EXPANDER_DRIVERS:
+        raise ValueError(f"unknown expander {expander}, supported are "
+                         f"{', '.join(EXPANDER_DRIVERS)}")
+
+    guard = "BOARD_LAYOUT_" + layout_file.stem.upper()
+    lines = [
+        f"// Generated by tools/layout_gen.py from layouts/{layout_file.name}, do not edit.",
+        f"#ifndef {guard}",
+        f"#define {guard}",
+        "",
+        "#include <stdint.h>",
+        "",
+        "#include <utility>",
+        "",
+        '#include "io_expander.h"',
+        '#include "keymap.h"',
+        '#include "usb_hid_keys.h"',
+        "",
+        f"constexpr uint8_t matrix_rows = {rows};",
+        f"constexpr uint8_t matrix_columns = {columns};",
+        "",
+        f"constexpr uint8_t rows_left[] = {c_list(pins['rows_left'])};",
+        f"constexpr uint8_t columns_left[] = {c_list(pins['columns_left'])};",
+        f"constexpr uint8_t rows_right[] = {c_list(pins['rows_right'])};",
+        f"constexpr uint8_t columns_right[] = {c_list(pins['columns_right'])};",
+        "",
+        "// port masks of the matrix pins, the left half is on the expander",
+        f"constexpr uint8_t row_mask_left = 0x{mask(pins['rows_left']):02X};",
+        f"constexpr uint8_t column_mask_left = 0x{mask(pins['columns_left']):02X};",
+        f"constexpr uint32_t row_mask_right = 0x{mask(pins['rows_right']):08X};",
+        f"constexpr uint32_t column_mask_right = 0x{mask(pins['columns_right']):08X};",
+        "",
+        "// matrix position of every physical key, in the order of the KLE layout",
+        f"constexpr uint8_t physical_key_count = {len(transform)};",
+        "constexpr std::pair<uint8_t, uint8_t> matrix_transform[physical_key_count] = {",
+    ]
+    for index in range(0, len(transform), 7):
+        chunk = transform[index:index + 7]
+        lines.append("    " + ", ".join(f"{{{row}, {column}}}" for row, column in chunk) + ",")
+    lines += [
+        "};",
+        "",
+        "constexpr uint8_t battery_reading_pin_analogue = "
+        f"{layout['battery_reading_pin_analogue']};",
+        f"typedef {EXPANDER_DRIVERS[expander]} BoardExpander;",
+        f"constexpr uint16_t expander_i2c = 0x{layout['expander_i2c']:02X};",
+        f"constexpr uint8_t button_pin = {layout['button_pin']};",
+        "",
+        f"const keymap_image<{len(layers)}, {rows}, {columns}> default_keymap{{",
+        f"    KEYMAP_IMAGE_HEADER({len(layers)}, {rows}, {columns}),",
+    ]
+    # one matrix row per line, wrapped between the halves if too long
+    split = len(pins["columns_left"])
+    for layer_index, layer in enumerate(layers):
+        for row_index, row in enumerate(layer):
+            prefix = ("    {{{" if layer_index == 0 else "     {{") if row_index == 0 else "      {"
+            suffix = "}" + ("}" if row_index == rows - 1 else "") + \
+                     ("}};" if row_index == rows - 1 and layer_index == len(layers) - 1 else ",")
+            line = prefix + ", ".join(str(action) for action in row) + suffix
+            if len(line) > 100:
+                lines.append(prefix + ", ".join(str(action) for action in row[:split]) + ",")
+                line = " " * len(prefix) + ", ".join(str(action) for action in row[split:]) + suffix
+            lines.append(line)
+    lines += [
+        "",
+        "#endif",
+        "",
+    ]
+    return "\n".join(lines)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("layout", type=pathlib.Path, help="layout file, e.g. layouts/aW_1.json")
+    parser.add_argument("output", type=pathlib.Path, help="generated header")
+    parser.add_argument("--keycodes", type=pathlib.Path,
+                        default=pathlib.Path(__file__).parent.parent / "src" / "usb_hid_keys.h")
+    args = parser.parse_args()
+
+    try:
+        header = generate(args.layout, keymap_pack.read_keycodes(args.keycodes))
+    except (KeyError, ValueError) as error:
+        print(f"{args.layout}: {error}", file=sys.stderr)
+        return 1
+
+    # keep the timestamp when nothing changed, so the sources are not rebuilt on every configure
+    if not args.output.exists() or args.output.read_text() != header:
+        args.output.parent.mkdir(parents=True, exist_ok=True)
+        args.output.write_text(header)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+"""
+Reports the RAM and flash use of each module from the linker map file and fails if a budget from
+the budget file is exceeded, or if heap allocation or exception support got linked in.
+
+Application sources are reported per source file, everything else per library. The budget file
+maps module names (as printed in the report) and "total" to their flash and RAM limits in bytes:
+
+    {"total": {"flash": 204800, "ram": 61440}, "modules": {"main": {"flash": 8192, "ram": 3072}}}
+"""
+
+import argparse
+import collections
+import json
+import pathlib
+import re
+import sys
+
+MEMORY_REGION = re.compile(r"^(?P<name>\w+)\s+0x(?P<origin>[0-9a-f]+)\s+0x(?P<length>[0-9a-f]+)")
+OUTPUT_SECTION = re.compile(r"^(?P<name>[.\w]+)\s+0x(?P<address>[0-9a-f]+)\s+0x(?P<size>[0-9a-f]+)"
+                            r"(?:\s+load address 0x(?P<load>[0-9a-f]+))?")
+INPUT_SECTION = re.compile(r"^ (?P<name>\S+)?\s+0x(?P<address>[0-9a-f]+)\s+0x(?P<size>[0-9a-f]+)"
+                           r"\s+(?P<object>\S.*)$")
+SECTION_NAME = re.compile(r"^ (?P<name>\S+)$")
+ARCHIVE_MEMBER = re.compile(r"(?:^|[/\\])lib(?P<archive>[\w.+-]+)\.a\((?P<member>[^)]+)\)$")
+
+# symbols that only end up in the image if something allocates from the heap or throws
+FORBIDDEN_SECTIONS = re.compile(r"\.(?:_Znwj|_Znaj|_Znwm|_Znam|malloc|_malloc_r|calloc|realloc|"
+                                r"__cxa_allocate_exception|__cxa_throw)$")
+
+
+def module_name(object_path):
+    match = ARCHIVE_MEMBER.search(object_path)
+    if not match:
+        return pathlib.PurePath(object_path).name.split(".")[0]
+    if match.group("archive") == "app":
+        return match.group("member").split(".")[0]
+    return match.group("archive")
+
+
+def parse_map(map_file):
+    regions = {}
+    usage = collections.defaultdict(lambda: {"flash": 0, "ram": 0})
+    forbidden = []
+
+    def region_of(address):
+        for name, (origin, length) in regions.items():
+            if origin <= address < origin + length:
+                return name
+        return None
+
+    state = "start"
+    flash_region = ram_region = None
+    loaded_from_flash = False
+    pending_name = None
+
+    for line in map_file.read_text().splitlines():
+        if line.startswith("Memory Configuration"):
+            state = "memory"
+            continue
+        if line.startswith("Linker script and memory map"):
+            state = "map"
+            flash_region = next((name for name in regions if "FLASH" in name.upper()), None)
+            ram_region = next((name for name in regions if "RAM" in name.upper()), None)
+            continue
+
+        if state == "memory":
+            match = MEMORY_REGION.match(line)
+            if match:
+                regions[match.group("name")] = (int(match.group("origin"), 16),
+                                                int(match.group("length"), 16))
+            continue
+
+        if state != "map":
+            continue
+
+        match = OUTPUT_SECTION.match(line)
+        if match:
+            load = match.group("load")
+            loaded_from_flash = load is not None and region_of(int(load, 16)) == flash_region
+            pending_name = None
+            continue
+
+        match = SECTION_NAME.match(line)
+        if match:
+            pending_name = match.group("name")
+            continue
+
+        match = INPUT_SECTION.match(line)
+        if not match:
+            pending_name = None
+            continue
+
+        name = match.group("name") or pending_name
+        pending_name = None
+        size = int(match.group("size"), 16)
+        if not name or name == "*fill*" or size == 0:
+            continue
+
+        module = module_name(match.group("object"))
+        region = region_of(int(match.group("address"), 16))
+        if region == flash_region:
+            usage[module]["flash"] += size
+        elif region == ram_region:
+            usage[module]["ram"] += size
+            if loaded_from_flash:
+                usage[module]["flash"] += size
+
+        if FORBIDDEN_SECTIONS.search(name):
+            forbidden.append(f"{name} ({module})")
+
+    return usage, forbidden
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("map", type=pathlib.Path, help="linker map file, e.g. zephyr/zephyr.map")
+    parser.add_argument("--budget", type=pathlib.Path, help="JSON budget file")
+    args = parser.parse_args()
+
+    if not args.map.exists():
+        print(f"error: map file {args.map} not found, build the firmware first", file=sys.stderr)
+        return 2
+
+    usage, forbidden = parse_map(args.map)
+    budget = json.loads(args.budget.read_text()) if args.budget else {}
+    module_budgets = budget.get("modules", {})
+    total = {"flash": sum(u["flash"] for u in usage.values()),
+             "ram": sum(u["ram"] for u in usage.values())}
+
+    failures = []
+
+    def check(name, used, limits):
+        marks = []
+        for kind in ("flash", "ram"):
+            limit = limits.get(kind)
+            if limit is not None and used[kind] > limit:
+                failures.append(f"{name} uses {used[kind]} bytes of {kind}, budget is {limit}")
+                marks.append(kind)
+        return " ".join(f"!{kind}" for kind in marks)
+
+    print(f"{'module':32} {'flash':>8} {'ram':>8}")
+    for name, used in sorted(usage.items(), key=lambda item: -item[1]["flash"]):
+        marks = check(name, used, module_budgets.get(name, {}))
+        print(f"{name:32} {used['flash']:8} {used['ram']:8} {marks}")
+    marks = check("total", total, budget.get("total", {}))
+    print(f"{'total':32} {total['flash']:8} {total['ram']:8} {marks}")
+
+    for name in module_budgets:
+        if name not in usage:
+            print(f"warning: module {name} from the budget is not in the map", file=sys.stderr)
+
+    for section in forbidden:
+        failures.append(f"heap or exception support linked in: {section}")
+
+    for failure in failures:
+        print(f"error: {failure}", file=sys.stderr)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,13 @@
+"""
+PlatformIO extra script adding the memory_budget target: pio run -e aW_1 -t memory_budget
+"""
+
+Import("env")
+
+env.AddCustomTarget(
+    name="memory_budget",
+    dependencies="$BUILD_DIR/${PROGNAME}.elf",
+    actions="$PYTHONEXE $PROJECT_DIR/tools/memory_budget.py $BUILD_DIR/${PROGNAME}.map "
+            "--budget $PROJECT_DIR/zephyr/memory_budget.json",
+    title="Memory budget",
+    description="Report RAM/flash use per module and check it against the budget")
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""
+Decodes the output of the 'trace dump' shell command into readable events.
+
+Usage: copy the console output of 'trace dump' into a file (or pipe it in) and run
+    trace_decode.py dump.txt
+"""
+
+import argparse
+import sys
+
+EVENTS = {
+    0x01: ("scan", "keys={0} cycles={1}"),
+    0x02: ("key down", "row={0} column={1}"),
+    0x03: ("key up", "row={0} column={1}"),
+    0x04: ("notify keys", "keycodes={0} modifiers=0x{1:02x}"),
+    0x05: ("notify release", ""),
+    0x06: ("notify failed", "err={1:d}"),
+    0x07: ("tap-hold", "hold={0} after={1}ms"),
+    0x08: ("macro start", "macro={0}"),
+    0x09: ("macro end", "macro={0} interrupted={1}"),
+    0x0A: ("buffer flush", "sent={0} stale={1}"),
+    0x0B: ("scan rate", "rate={0} delay={1}ms"),
+    0x0C: ("stuck key", "row={0} column={1}"),
+    0x0D: ("stuck released", "row={0} column={1}"),
+    0x10: ("connected", "err={0}"),
+    0x11: ("disconnected", "reason=0x{0:02x}"),
+    0x12: ("security changed", "level={0} err={1}"),
+    0x13: ("params updated", "interval={0} latency={1}"),
+    0x14: ("ccc changed", "attr={0} value={1}"),
+    0x15: ("boot phase", "phase={0} at={1}us"),
+    0x16: ("tx power", "{0}dBm rssi={1}dBm"),
+    0x20: ("battery voltage", "{0}mV"),
+    0x21: ("power profile", "profile={0} battery={1}%"),
+    0x30: ("error", "source={0} err={1:d}"),
+}
+
+ERRORS = {0x01: "adc", 0x02: "advertising", 0x03: "pairing", 0x04: "security"}
+
+SCAN_RATES = ["active", "idle", "slow"]
+
+BOOT_PHASES = ["main", "bt_enabled", "bt_ready", "bonds_loaded", "advertising", "hardware_ready",
+               "config_loaded", "connected", "secured"]
+
+
+def signed16(value):
+    return value - (1 << 16) if value & (1 << 15) else value
+
+
+def signed32(value):
+    return value - (1 << 32) if value & (1 << 31) else value
+
+
+def decode(lines):
+    frequency = None
+    first = None
+
+    for line in lines:
+        fields = line.split()
+        if len(fields) == 3 and fields[0] == "trace":
+            frequency = int(fields[1])
+            continue
+        if frequency is None or len(fields) != 4:
+            continue
+
+        try:
+            timestamp, event, arg0, arg1 = (int(field, 16) for field in fields)
+        except ValueError:
+            continue
+
+        if first is None:
+            first = timestamp
+        elapsed_ms = ((timestamp - first) & 0xFFFFFFFF) * 1000.0 / frequency
+
+        name, arguments = EVENTS.get(event, (f"event 0x{event:02x}", "{0} {1}"))
+        if event == 0x30:
+            arg0 = ERRORS.get(arg0, arg0)
+        if event == 0x0B and arg0 < len(SCAN_RATES):
+            arg0 = SCAN_RATES[arg0]
+        if event == 0x15 and arg0 < len(BOOT_PHASES):
+            arg0 = BOOT_PHASES[arg0]
+        if event == 0x16:
+            arg0 = signed16(arg0)
+        if event in (0x06, 0x16, 0x30):
+            arg1 = signed32(arg1)
+
+        yield f"{elapsed_ms:12.3f} ms  {name:<18} {arguments.format(arg0, arg1)}"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("dump", nargs="?", type=argparse.FileType("r"), default=sys.stdin)
+    args = parser.parse_args()
+
+    for line in decode(args.dump):
+        print(line)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+"""
+Measures the scan to report latency from the frames of the UART report transport.
+
+Switch the keyboard to the UART transport with the 'transport uart' shell command, then either
+read the console directly (needs pyserial)
+    uart_latency.py --port /dev/ttyACM0 --duration 30
+or capture the raw console output to a file first and decode it
+    uart_latency.py capture.bin
+
+Every scan that changed the pressed keys is paired with the first report sent after it. Log and
+shell output between the frames is skipped.
+"""
+
+import argparse
+import statistics
+import sys
+import time
+
+SYNC = b"\x55\xaa"
+FRAME_SCAN = 0x01
+FRAME_REPORT = 0x02
+PAYLOAD_LENGTHS = {FRAME_SCAN: 1, FRAME_REPORT: 8}
+
+
+def crc8_ccitt(data, crc=0xFF):
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x07) & 0xFF if crc & 0x80 else (crc << 1) & 0xFF
+    return crc
+
+
+def parse_frames(data):
+    """Yields (type, sequence, timestamp, payload) of all valid frames in the data."""
+    position = data.find(SYNC)
+    while position >= 0:
+        header = position + len(SYNC)
+        if header + 6 > len(data):
+            return
+        frame_type = data[header]
+        length = PAYLOAD_LENGTHS.get(frame_type)
+        end = header + 6 + (length or 0)
+        if length is None or end >= len(data) or crc8_ccitt(data[header:end]) != data[end]:
+            position = data.find(SYNC, position + 1)
+            continue
+
+        sequence = data[header + 1]
+        timestamp = int.from_bytes(data[header + 2:header + 6], "little")
+        yield frame_type, sequence, timestamp, bytes(data[header + 6:end])
+        position = data.find(SYNC, end + 1)
+
+
+def measure(frames, frequency):
+    latencies_us = []
+    reports = 0
+    lost = 0
+    first = last = None
+    last_sequence = None
+    pending_scan = None
+
+    for frame_type, sequence, timestamp, payload in frames:
+        if last_sequence is not None and sequence != (last_sequence + 1) & 0xFF:
+            lost += (sequence - last_sequence - 1) & 0xFF
+            # the scan of the next report may be among the lost frames
+            pending_scan = None
+        last_sequence = sequence
+
+        if frame_type == FRAME_SCAN:
+            pending_scan = timestamp
+            continue
+
+        reports += 1
+        if first is None:
+            first = timestamp
+        last = timestamp
+        if pending_scan is not None:
+            cycles = (timestamp - pending_scan) & 0xFFFFFFFF
+            latencies_us.append(cycles * 1e6 / frequency)
+            pending_scan = None
+
+    return latencies_us, reports, lost, first, last
+
+
+def read_port(port, baudrate, duration):
+    import serial
+
+    data = bytearray()
+    with serial.Serial(port, baudrate, timeout=0.1) as connection:
+        end = time.monotonic() + duration
+        while time.monotonic() < end:
+            data += connection.read(4096)
+    return data
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("capture", nargs="?", type=argparse.FileType("rb"),
+                        help="raw console capture, read from --port if not given")
+    parser.add_argument("--port", help="serial port of the keyboard console")
+    parser.add_argument("--baudrate", type=int, default=115200)
+    parser.add_argument("--duration", type=float, default=10.0, help="seconds to read the port")
+    parser.add_argument("--frequency", type=int, default=32768,
+                        help="hardware cycles per second of the timestamps")
+    args = parser.parse_args()
+
+    if args.capture:
+        data = args.capture.read()
+    elif args.port:
+        data = read_port(args.port, args.baudrate, args.duration)
+    else:
+        parser.error("either a capture file or --port is needed")
+
+    latencies_us, reports, lost, first, last = measure(parse_frames(data), args.frequency)
+    if not reports:
+        sys.exit("no report frames found, is the UART transport active?")
+
+    print(f"reports     {reports}, {lost} frames lost")
+    seconds = ((last - first) & 0xFFFFFFFF) / args.frequency
+    if seconds:
+        print(f"rate        {(reports - 1) / seconds:.1f} reports/s")
+    if latencies_us:
+        latencies_us.sort()
+        percentile_99 = latencies_us[min(len(latencies_us) - 1, int(len(latencies_us) * 0.99))]
+        print(f"latency     min {latencies_us[0]:.0f} us, median "
+              f"{statistics.median(latencies_us):.0f} us, p99 {percentile_99:.0f} us, "
+              f"max {latencies_us[-1]:.0f} us ({len(latencies_us)} scans)")
+
+
+if __name__ == "__main__":
+    main()